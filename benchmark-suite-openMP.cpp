@@ -0,0 +1,435 @@
+// a benchmark of the hot loop of every snippet, over sizes and thread counts
+//
+// The snippets in this directory demonstrate a pattern each, on a hard-coded
+// RES 10 or res = 100, and print their results. This program runs the loop
+// at the heart of each pattern for a sweep of sizes and thread counts, and
+// writes the timings as JSON, for plotting or for comparing two machines or
+// compilers:
+//
+//   static_member_read    dataset2[i] = C.report_number(i), with C a local
+//                         instance reading from a static member array
+//                         (class-static-member-openMP.cpp)
+//   firstprivate_copy     firstprivate(C) of a class holding a pointer, which
+//                         reads and writes through it
+//                         (class-shared-array-openMP.cpp)
+//   nested_firstprivate   firstprivate(C) of a class holding a class
+//                         (class-in-class-openMP.cpp)
+//   present_fill          fill of a grid that is present on the device,
+//                         followed by an update self (openacc-present-test.cpp)
+//   multi_D_copy          copyAB on a square 2D array with a row-pointer table
+//                         (openacc-multi-D-array.c)
+//   partial_update        host modification of a tenth of an array, followed
+//                         by an update device of that part
+//                         (update-device-openacc.c)
+//
+// The loops run with OpenMP on the host, except the fill of present_fill,
+// which is an OpenACC parallel loop when compiled with OpenACC, as in
+// openacc-present-test.cpp. The OpenACC data directives of the last three
+// patterns are kept; with GCC's host fallback they cost nothing, and compiled
+// for a GPU they measure the transfers as well.
+//
+// Sizes go from 10 up to 10^max_exponent elements (default 10^8, up to 10^9
+// if memory allows; sizes that do not fit in the available memory are left
+// out). Thread counts go through the powers of two up to the number of
+// hardware threads, plus that number itself. Every combination is timed
+// repeatedly (at least 5 times, and for roughly 0.2 s at most), and the JSON
+// holds the median, the 99th percentile and the bandwidth at the median,
+// based on the bytes each pattern reads and writes in one run.
+//
+// compiled with g++ benchmark-suite-openMP.cpp -fopenmp -fopenacc -O2 -Wall
+// run with ./a.out [max_exponent] > results.json
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+#include <omp.h>
+
+#define MIN_SAMPLES 5
+#define MAX_SAMPLES 101
+#define TIME_BUDGET 0.2 // seconds per combination of pattern, size, threads
+
+////////////////////////////////////////////////////////////////////////////////
+// the classes of the snippets
+
+class c_test_static
+{
+  public:
+    static long* dataset;
+    long report_number(long i) { return dataset[i]; }
+};
+
+long* c_test_static::dataset = NULL;
+
+class c_test_shared
+{
+  public:
+    long* dataset;
+};
+
+class c_test_inner
+{
+  public:
+    int n;
+};
+
+class c_test_outer
+{
+  public:
+    c_test_inner Cin;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// the patterns. setup and teardown are not timed, run is.
+
+class bench_pattern
+{
+  public:
+    virtual ~bench_pattern() {}
+    virtual const char* name() = 0;
+    virtual long elements() = 0; // what setup(n) actually allocated
+    virtual double bytes_moved() = 0; // read plus written by one run
+    virtual double memory_per_element() = 0; // allocated
+    virtual void setup(long n) = 0;
+    virtual void run() = 0;
+    virtual void teardown() = 0;
+};
+
+class static_member_read : public bench_pattern
+{
+  public:
+    long n;
+    long* dataset2;
+
+    const char* name() { return "static_member_read"; }
+    long elements() { return n; }
+    double bytes_moved() { return 16. * n; }
+    double memory_per_element() { return 16.; }
+
+    void setup(long n_arg)
+    {
+      n = n_arg;
+      c_test_static::dataset = new long[n];
+      dataset2 = new long[n];
+      #pragma omp parallel for schedule(static)
+      for (long i = 0; i < n; i++) { c_test_static::dataset[i] = i; dataset2[i] = 0; }
+    }
+
+    void run()
+    {
+      #pragma omp parallel for schedule(static)
+      for (long i = 0; i < n; i++)
+      {
+        c_test_static C; // create a local instance of the class
+        dataset2[i] = C.report_number(i);
+      }
+    }
+
+    void teardown()
+    {
+      delete[] c_test_static::dataset;
+      delete[] dataset2;
+    }
+};
+
+class firstprivate_copy : public bench_pattern
+{
+  public:
+    long n;
+    c_test_shared C;
+    long* dataset2;
+
+    const char* name() { return "firstprivate_copy"; }
+    long elements() { return n; }
+    double bytes_moved() { return 24. * n; }
+    double memory_per_element() { return 16.; }
+
+    void setup(long n_arg)
+    {
+      n = n_arg;
+      C.dataset = new long[n];
+      dataset2 = new long[n];
+      #pragma omp parallel for schedule(static)
+      for (long i = 0; i < n; i++) { C.dataset[i] = i; dataset2[i] = 0; }
+    }
+
+    void run()
+    {
+      c_test_shared C_local = C;
+      long* d2 = dataset2;
+
+      #pragma omp parallel for firstprivate(C_local) schedule(static)
+      for (long i = 0; i < n; i++)
+      {
+        d2[i] = C_local.dataset[i];
+        C_local.dataset[i] = omp_get_thread_num();
+      }
+    }
+
+    void teardown()
+    {
+      delete[] C.dataset;
+      delete[] dataset2;
+    }
+};
+
+class nested_firstprivate : public bench_pattern
+{
+  public:
+    long n;
+    long* out;
+
+    const char* name() { return "nested_firstprivate"; }
+    long elements() { return n; }
+    double bytes_moved() { return 8. * n; }
+    double memory_per_element() { return 8.; }
+
+    void setup(long n_arg)
+    {
+      n = n_arg;
+      out = new long[n];
+      #pragma omp parallel for schedule(static)
+      for (long i = 0; i < n; i++) out[i] = 0;
+    }
+
+    void run()
+    {
+      c_test_outer C;
+      long* o = out;
+      C.Cin.n = 42;
+
+      #pragma omp parallel for firstprivate(C) schedule(static)
+      for (long i = 0; i < n; i++)
+      {
+        o[i] = C.Cin.n + i;
+      }
+    }
+
+    void teardown() { delete[] out; }
+};
+
+class present_fill : public bench_pattern
+{
+  public:
+    long n;
+    double* X;
+
+    const char* name() { return "present_fill"; }
+    long elements() { return n; }
+    double bytes_moved() { return 8. * n; }
+    double memory_per_element() { return 8.; }
+
+    void setup(long n_arg)
+    {
+      n = n_arg;
+      X = (double*) malloc(n * sizeof(double));
+      #pragma omp parallel for schedule(static)
+      for (long i = 0; i < n; i++) X[i] = 0.;
+      #pragma acc enter data copyin(X[0:n])
+    }
+
+    void run()
+    {
+      double* x = X;
+
+      // filled where the data is present, as fill() does, so that the update
+      // self brings back the new values
+#ifdef _OPENACC
+      #pragma acc parallel loop present(x[0:n])
+#else
+      #pragma omp parallel for schedule(static)
+#endif
+      for (long i = 0; i < n; i++)
+      {
+        x[i] = 42;
+      }
+      #pragma acc update self(x[0:n])
+    }
+
+    void teardown()
+    {
+      #pragma acc exit data delete(X[0:n])
+      free(X);
+    }
+};
+
+class multi_D_copy : public bench_pattern
+{
+  public:
+    long N; // the side of the square arrays
+    double** A;
+    double** B;
+
+    const char* name() { return "multi_D_copy"; }
+    long elements() { return N * N; } // the largest square <= n
+    double bytes_moved() { return 16. * N * N; }
+    double memory_per_element() { return 16.; }
+
+    static double** allocate(long N)
+    {
+      double** A = (double**) malloc(N * sizeof(double*));
+      A[0] = (double*) malloc(N * N * sizeof(double));
+      for (long i = 0; i < N; i++) A[i] = A[0] + i * N;
+      return A;
+    }
+
+    void setup(long n)
+    {
+      N = (long) sqrt_floor(n);
+      A = allocate(N);
+      B = allocate(N);
+      #pragma omp parallel for schedule(static)
+      for (long i = 0; i < N; i++)
+        for (long j = 0; j < N; j++) { A[i][j] = (double) (i * N + j); B[i][j] = 0.; }
+    }
+
+    void run()
+    {
+      double** a = A;
+      double** b = B;
+
+      #pragma omp parallel for schedule(static)
+      for (long i = 0; i < N; i++)
+        for (long j = 0; j < N; j++)
+          b[i][j] = a[i][j];
+    }
+
+    void teardown()
+    {
+      free(A[0]); free(A);
+      free(B[0]); free(B);
+    }
+
+    static long sqrt_floor(long n)
+    {
+      long r = 1;
+      while ((r + 1) * (r + 1) <= n) r++;
+      return r;
+    }
+};
+
+class partial_update : public bench_pattern
+{
+  public:
+    long n;
+    double* A;
+
+    const char* name() { return "partial_update"; }
+    long elements() { return n; }
+    double bytes_moved() { return 8. * (n / 10 > 0 ? n / 10 : 1); }
+    double memory_per_element() { return 8.; }
+
+    void setup(long n_arg)
+    {
+      n = n_arg;
+      A = (double*) malloc(n * sizeof(double));
+      #pragma omp parallel for schedule(static)
+      for (long i = 0; i < n; i++) A[i] = 1.;
+      #pragma acc enter data copyin(A[0:n])
+    }
+
+    void run()
+    {
+      double* a = A;
+      long start = n / 5;
+      long count = n / 10 > 0 ? n / 10 : 1;
+
+      #pragma omp parallel for schedule(static)
+      for (long i = start; i < start + count; i++) a[i] = 2.;
+      #pragma acc update device(a[start:count])
+    }
+
+    void teardown()
+    {
+      #pragma acc exit data delete(A[0:n])
+      free(A);
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+double percentile(std::vector<double>& t, double p)
+{
+  std::sort(t.begin(), t.end());
+  long k = (long) (p * (t.size() - 1) + 0.5);
+  return t[k];
+}
+
+int main(int argc, char** argv)
+{
+  int max_exponent = argc > 1 ? atoi(argv[1]) : 8;
+  int num_procs = omp_get_num_procs();
+  double available = (double) sysconf(_SC_AVPHYS_PAGES) * sysconf(_SC_PAGESIZE);
+  bool first = true;
+
+  static_member_read p0;
+  firstprivate_copy p1;
+  nested_firstprivate p2;
+  present_fill p3;
+  multi_D_copy p4;
+  partial_update p5;
+  bench_pattern* patterns[] = { &p0, &p1, &p2, &p3, &p4, &p5 };
+  const int num_patterns = sizeof(patterns) / sizeof(patterns[0]);
+
+  std::vector<int> thread_counts;
+  for (int t = 1; t < num_procs; t *= 2) thread_counts.push_back(t);
+  thread_counts.push_back(num_procs);
+
+  printf("{\n  \"hardware_threads\": %d,\n  \"results\": [\n", num_procs);
+
+  for (int p = 0; p < num_patterns; p++)
+  {
+    bench_pattern* P = patterns[p];
+    long n = 10;
+
+    for (int e = 1; e <= max_exponent; e++, n *= 10)
+    {
+      // leave out sizes that would not fit in memory, with some room to spare
+      if (P->memory_per_element() * n > 0.8 * available)
+      {
+        fprintf(stderr, "%s: skipping 10^%d elements (not enough memory)\n",
+          P->name(), e);
+        continue;
+      }
+
+      P->setup(n);
+
+      for (size_t k = 0; k < thread_counts.size(); k++)
+      {
+        int threads = thread_counts[k];
+        std::vector<double> samples;
+        double total = 0.;
+
+        omp_set_num_threads(threads);
+        P->run(); // warm up
+
+        while ((int) samples.size() < MAX_SAMPLES
+          && ((int) samples.size() < MIN_SAMPLES || total < TIME_BUDGET))
+        {
+          double t0 = omp_get_wtime();
+          P->run();
+          double t = omp_get_wtime() - t0;
+          samples.push_back(t);
+          total += t;
+        }
+
+        int num_samples = samples.size();
+        double median = percentile(samples, 0.5);
+        double p99 = percentile(samples, 0.99);
+
+        printf("%s    {\"pattern\": \"%s\", \"elements\": %ld, \"threads\": %d, "
+          "\"samples\": %d, \"median_s\": %.9e, \"p99_s\": %.9e, "
+          "\"gb_per_s\": %.4f}", first ? "" : ",\n", P->name(), P->elements(),
+          threads, num_samples, median, p99, P->bytes_moved() / median * 1e-9);
+        first = false;
+        fflush(stdout);
+      }
+
+      P->teardown();
+    }
+  }
+
+  printf("\n  ]\n}\n");
+  return 0;
+}
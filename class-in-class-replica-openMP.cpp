@@ -0,0 +1,319 @@
+// testing per-thread copies of a class that persist across parallel regions
+//
+// HJvE's class-in-class-openMP.cpp shows that firstprivate(C) copies the
+// whole of C, including the c_test_inner inside it, into every thread. It
+// does so at the start of every parallel region. For an object of a few
+// bytes that does not matter, but an outer class of tens of kilobytes, used
+// in a time step loop with a parallel region per step, gets copied threads
+// times per step, even though it typically changes only now and then.
+//
+// replica_cache<T> keeps one copy of a master object per thread, alive from
+// one region to the next. The master carries a version number, and
+// master_modified() (called from serial code, after changing the master)
+// increases it. Inside a region,
+//
+//   const T& C = cache.get();
+//
+// hands the calling thread its copy, after copying the master into it if
+// the version it was made from is out of date. Between modifications of the
+// master, a region costs one comparison per thread instead of a copy.
+// get_private() hands out the copy for modification, as firstprivate allows;
+// the copy is then refreshed on its next use, so that every region starts
+// from the master as with firstprivate.
+//
+// The cache has a slot for each of omp_get_max_threads() threads at the time
+// it is built, and is meant for regions that are not nested. get() stops the
+// program for a thread that has no slot of its own.
+//
+// Members that are large and rarely change can also be held as a
+// cow_member<M> (copy on write): copying the class then only copies a shared
+// pointer to the member, and the member itself is only copied by write(),
+// when the handle is shared. With that, even a refresh (or firstprivate
+// itself) leaves the large member alone.
+//
+// main() runs a time step loop of up to 10000 regions, with the master
+// modified every 100 steps, and compares firstprivate with the replica
+// cache, for an outer class holding a 32 KiB table directly and one holding
+// it as a cow_member.
+//
+// compiled with g++ class-in-class-replica-openMP.cpp -fopenmp -O2 -Wall
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <array>
+#include <memory>
+#include <omp.h>
+
+#define TABLE_SIZE 4096  // doubles in the outer table, 32 KiB
+#define INNER_SIZE 512   // doubles in c_test_inner, 4 KiB
+#define MODIFY_EVERY 100 // steps between modifications of the master
+#define WORK 2000        // iterations per region
+
+////////////////////////////////////////////////////////////////////////////////
+// the replica cache
+
+template <class T>
+class replica_cache
+{
+  public:
+
+    replica_cache(const T& master_arg)
+      : master(master_arg), version(0), slots(omp_get_max_threads()) {}
+
+    ~replica_cache()
+    {
+      for (size_t t = 0; t < slots.size(); t++) delete slots[t].copy;
+    }
+
+    // to be called outside of parallel regions, after changing the master
+    void master_modified() { version++; }
+
+    // the calling thread's copy, for reading
+    const T& get()
+    {
+      replica_slot& s = slot();
+      if (s.version != version) refresh(s);
+      return *s.copy;
+    }
+
+    // the calling thread's copy, for modification in this region only
+    T& get_private()
+    {
+      replica_slot& s = slot();
+      if (s.version != version) refresh(s);
+      s.version = -1; // no longer equal to the master
+      return *s.copy;
+    }
+
+    long refreshes() const
+    {
+      long r = 0;
+      for (size_t t = 0; t < slots.size(); t++) r += slots[t].refreshes;
+      return r;
+    }
+
+  protected:
+
+    // one cache line (at least) per thread, so that checking the version
+    // does not bounce lines between threads
+    struct alignas(64) replica_slot
+    {
+      T* copy = NULL;
+      long version = -1;
+      long refreshes = 0;
+    };
+
+    const T& master;
+    long version;
+    std::vector<replica_slot> slots;
+
+    // the slot of the calling thread. There is one per thread of the team
+    // size at construction, and only for one level of parallelism: in a nested
+    // region, threads of different teams would share a slot.
+    replica_slot& slot()
+    {
+      int t = omp_get_thread_num();
+      if ((size_t) t >= slots.size() || omp_get_level() > 1)
+      {
+        printf("replica_cache: thread %d at level %d, but only %zu slots for "
+          "one level\n", t, omp_get_level(), slots.size());
+        exit(1);
+      }
+      return slots[t];
+    }
+
+    // the first copy is made by the thread that uses it, so that its pages
+    // are placed near that thread
+    void refresh(replica_slot& s)
+    {
+      if (s.copy == NULL) s.copy = new T(master); else *s.copy = master;
+      s.version = version;
+      s.refreshes++;
+    }
+};
+
+// a member that is shared between copies until one of them writes to it
+template <class M>
+class cow_member
+{
+  public:
+
+    cow_member() : p(std::make_shared<M>()) {}
+
+    const M& read() const { return *p; }
+
+    M& write()
+    {
+      if (p.use_count() > 1) p = std::make_shared<M>(*p);
+      return *p;
+    }
+
+  protected:
+
+    std::shared_ptr<M> p;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// the classes of class-in-class-openMP.cpp, grown to realistic sizes
+
+class c_test_inner
+{
+  public:
+
+    int n;
+    double coefficients[INNER_SIZE];
+};
+
+class c_test_outer
+{
+  public:
+
+    c_test_inner Cin;
+    double table[TABLE_SIZE];
+
+    const double* get_table() const { return table; }
+    double* set_table() { return table; }
+};
+
+class c_test_outer_cow
+{
+  public:
+
+    c_test_inner Cin;
+    cow_member<std::array<double, TABLE_SIZE> > table;
+
+    const double* get_table() const { return table.read().data(); }
+    double* set_table() { return table.write().data(); }
+};
+
+template <class Outer>
+void initialize(Outer& C)
+{
+  C.Cin.n = 42;
+  for (int k = 0; k < INNER_SIZE; k++) C.Cin.coefficients[k] = 1.;
+  double* table = C.set_table();
+  for (int k = 0; k < TABLE_SIZE; k++) table[k] = 1.;
+}
+
+// what changes every MODIFY_EVERY steps: a small member, and every tenth time
+// the large table as well
+template <class Outer>
+void modify(Outer& C, int step)
+{
+  C.Cin.n++;
+  if (step % (10 * MODIFY_EVERY) == 0) C.set_table()[step % TABLE_SIZE] += 1.;
+}
+
+template <class Outer>
+double region_work(const Outer& C, long i)
+{
+  return C.Cin.n * C.Cin.coefficients[i % INNER_SIZE]
+    + C.get_table()[(i * 7) % TABLE_SIZE];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+template <class Outer>
+double run_firstprivate(int steps, double* result)
+{
+  Outer C;
+  double sum = 0.;
+  initialize(C);
+
+  double t0 = omp_get_wtime();
+  for (int step = 1; step <= steps; step++)
+  {
+    if (step % MODIFY_EVERY == 0) modify(C, step);
+
+    #pragma omp parallel for firstprivate(C) reduction(+:sum)
+    for (long i = 0; i < WORK; i++)
+    {
+      sum += region_work(C, i);
+    }
+  }
+  *result = sum;
+  return omp_get_wtime() - t0;
+}
+
+template <class Outer>
+double run_replica(int steps, double* result, long* refreshes)
+{
+  Outer C;
+  double sum = 0.;
+  initialize(C);
+  replica_cache<Outer> cache(C);
+
+  double t0 = omp_get_wtime();
+  for (int step = 1; step <= steps; step++)
+  {
+    if (step % MODIFY_EVERY == 0)
+    {
+      modify(C, step);
+      cache.master_modified();
+    }
+
+    #pragma omp parallel reduction(+:sum)
+    {
+      const Outer& Cp = cache.get();
+      #pragma omp for
+      for (long i = 0; i < WORK; i++)
+      {
+        sum += region_work(Cp, i);
+      }
+    }
+  }
+  *result = sum;
+  *refreshes = cache.refreshes();
+  return omp_get_wtime() - t0;
+}
+
+int main()
+{
+  const int step_counts[] = { 10, 100, 1000, 10000 };
+  int errors = 0;
+
+  printf("outer class: %zu bytes, with cow_member: %zu bytes, %d threads\n",
+    sizeof(c_test_outer), sizeof(c_test_outer_cow), omp_get_max_threads());
+  printf("times in microseconds per region\n");
+  printf("%8s %14s %14s %14s %14s %10s\n", "regions", "firstprivate",
+    "replica", "fp + cow", "replica + cow", "refreshes");
+
+  for (int s = 0; s < 4; s++)
+  {
+    int steps = step_counts[s];
+    double r[4], t[4];
+    long refreshes, refreshes_cow;
+
+    t[0] = run_firstprivate<c_test_outer>(steps, &r[0]);
+    t[1] = run_replica<c_test_outer>(steps, &r[1], &refreshes);
+    t[2] = run_firstprivate<c_test_outer_cow>(steps, &r[2]);
+    t[3] = run_replica<c_test_outer_cow>(steps, &r[3], &refreshes_cow);
+
+    bool ok = r[1] == r[0] && r[2] == r[0] && r[3] == r[0];
+    errors += !ok;
+
+    printf("%8d", steps);
+    for (int k = 0; k < 4; k++) printf(" %14.3f", 1e6 * t[k] / steps);
+    printf(" %10ld %s\n", refreshes, ok ? "" : "results differ");
+  }
+
+  // get_private: modifications stay within the region, as with firstprivate
+  c_test_outer C;
+  initialize(C);
+  replica_cache<c_test_outer> cache(C);
+  int wrong = 0;
+  for (int step = 0; step < 3; step++)
+  {
+    #pragma omp parallel reduction(+:wrong)
+    {
+      c_test_outer& Cp = cache.get_private();
+      wrong += Cp.Cin.n != 42;
+      Cp.Cin.n = omp_get_thread_num() + 1000;
+    }
+  }
+  printf("get_private: %s\n", wrong == 0 ? "every region saw the master"
+    : "a region saw a modified copy");
+
+  return errors + wrong != 0;
+}
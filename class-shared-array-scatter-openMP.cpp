@@ -0,0 +1,497 @@
+// testing concurrent scatter-adds into a shared array
+//
+// motivation: in class-shared-array-openMP.cpp every thread writes through
+// its copy of the pointer C.dataset, to C.dataset[i], and no two threads
+// ever write the same entry. A histogram is the same loop with the index
+// coming from the data, C.dataset[idx[k]] += 1, and then two threads can hit
+// the same entry at the same time. An atomic add per update is correct but
+// slow when updates collide often (a skewed distribution sends most of them
+// to a handful of entries, whose cache lines bounce between cores). The
+// alternatives:
+//
+//   SCATTER_ATOMIC          #pragma omp atomic on the shared array (for
+//                           arithmetic types; others get SCATTER_LOCK_STRIPED)
+//   SCATTER_PRIVATE_DENSE   every thread adds into a private copy of the
+//                           whole array (thread 0 directly into the shared
+//                           one); at the end, the copies are summed pairwise
+//                           in log2(threads) rounds, all threads working on
+//                           every round
+//   SCATTER_PRIVATE_SPARSE  as dense, but the private copies are hash maps
+//                           holding only the entries a thread touched, for
+//                           arrays too large to copy per thread; the maps are
+//                           merged pairwise, in parallel over the pairs, and
+//                           the last one is added to the shared array
+//   SCATTER_LOCK_STRIPED    a lock per stripe of entries, for value types
+//                           that can not be updated atomically (a struct of
+//                           several members, say)
+//
+// scatter_reducer<T> wraps all of them:
+//
+//   scatter_reducer<long> R(C.dataset, n, expected_updates);
+//   #pragma omp parallel
+//   {
+//     R.begin();
+//     #pragma omp for
+//     for (k = 0; k < m; k++) R.add(idx[k], 1);
+//     R.merge();
+//   }
+//
+// SCATTER_PRIVATE privatizes densely if the copies fit in DENSE_BUDGET, and
+// sparsely if they do not. With SCATTER_AUTO (the default) the reducer picks
+// dense privatization if there is only one thread (which then adds directly,
+// nothing to merge), or if the copies fit and summing them costs less than
+// the updates themselves; otherwise atomics, or lock striping if T is not
+// arithmetic. On an array too large to copy, uniform updates rarely collide
+// and atomics are the cheapest; whether the updates are instead skewed onto a
+// few hot entries, which privatization absorbs, is not known up front, so for
+// those SCATTER_PRIVATE has to be asked for.
+//
+// main() builds histograms with every strategy, for arrays from cache-sized
+// to much larger than cache, with indices spread uniformly and heavily
+// skewed towards the first entries, and checks them against a serial run.
+//
+// compiled with g++ class-shared-array-scatter-openMP.cpp -fopenmp -O2 -Wall
+// run with ./a.out [log2 of the number of updates]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <type_traits>
+#include <omp.h>
+
+#define DENSE_BUDGET (256L << 20) // bytes, for all private copies together
+#define SPARSE_EMPTY -1L
+#define STRIPE_ENTRIES 8 // consecutive entries per lock, a cache line of longs
+
+enum scatter_strategy {SCATTER_AUTO, SCATTER_ATOMIC, SCATTER_PRIVATE_DENSE,
+  SCATTER_PRIVATE_SPARSE, SCATTER_LOCK_STRIPED, SCATTER_PRIVATE};
+
+const char* strategy_names[] = { "auto", "atomic", "dense", "sparse",
+  "striped", "private" };
+
+////////////////////////////////////////////////////////////////////////////////
+// the private hash map of a thread, open addressing with linear probing
+
+template <class T>
+class alignas(64) sparse_map
+{
+  public:
+
+    long* keys;
+    T* values;
+    long capacity; // a power of 2
+    long size;
+
+    void init(long initial_capacity)
+    {
+      capacity = initial_capacity;
+      size = 0;
+      keys = new long[capacity];
+      values = new T[capacity];
+      for (long s = 0; s < capacity; s++) keys[s] = SPARSE_EMPTY;
+    }
+
+    void release()
+    {
+      delete[] keys;
+      delete[] values;
+      keys = NULL;
+      values = NULL;
+    }
+
+    void add(long key, const T& v)
+    {
+      long s = slot(key);
+
+      if (keys[s] == key) { values[s] += v; return; }
+
+      if (2 * (size + 1) > capacity)
+      {
+        grow();
+        s = slot(key);
+      }
+      keys[s] = key;
+      values[s] = v;
+      size++;
+    }
+
+    void merge_from(const sparse_map& other)
+    {
+      for (long s = 0; s < other.capacity; s++)
+        if (other.keys[s] != SPARSE_EMPTY) add(other.keys[s], other.values[s]);
+    }
+
+  protected:
+
+    // the slot holding key, or the empty slot where it would go
+    long slot(long key) const
+    {
+      long s = (long) (((unsigned long) key * 0x9E3779B97F4A7C15UL) >> 20)
+        & (capacity - 1);
+      while (keys[s] != key && keys[s] != SPARSE_EMPTY) s = (s + 1) & (capacity - 1);
+      return s;
+    }
+
+    void grow()
+    {
+      long* old_keys = keys;
+      T* old_values = values;
+      long old_capacity = capacity;
+
+      init(2 * capacity);
+      for (long s = 0; s < old_capacity; s++)
+        if (old_keys[s] != SPARSE_EMPTY) add(old_keys[s], old_values[s]);
+
+      delete[] old_keys;
+      delete[] old_values;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// the reducer
+
+template <class T>
+class scatter_reducer
+{
+  public:
+
+    scatter_reducer(T* target_arg, long n_arg, long expected_updates = -1,
+      scatter_strategy strategy = SCATTER_AUTO);
+    ~scatter_reducer();
+
+    // all three to be called by every thread of the parallel region
+    void begin();
+    void add(long i, const T& v);
+    void merge();
+
+    scatter_strategy strategy() const { return chosen; }
+
+  protected:
+
+    T* target;
+    long n;
+    int threads;
+    scatter_strategy chosen;
+
+    T** dense;           // per thread, dense[0] is target
+    sparse_map<T>* sparse; // per thread
+    omp_lock_t* locks;
+    long num_locks;
+};
+
+template <class T>
+scatter_reducer<T>::scatter_reducer(T* target_arg, long n_arg,
+  long expected_updates, scatter_strategy strategy)
+{
+  target = target_arg;
+  n = n_arg;
+  threads = omp_get_max_threads();
+  dense = NULL;
+  sparse = NULL;
+  locks = NULL;
+  num_locks = 0;
+
+  if (expected_updates < 0) expected_updates = n;
+  double copies = (double) n * (threads - 1);
+  bool dense_fits = copies * sizeof(T) <= DENSE_BUDGET;
+
+  if (strategy == SCATTER_PRIVATE)
+  {
+    strategy = dense_fits ? SCATTER_PRIVATE_DENSE : SCATTER_PRIVATE_SPARSE;
+  }
+  else if (strategy == SCATTER_AUTO)
+  {
+    if (threads == 1 || (dense_fits && copies <= expected_updates))
+      strategy = SCATTER_PRIVATE_DENSE;
+    else if (std::is_arithmetic<T>::value)
+      strategy = SCATTER_ATOMIC;
+    else
+      strategy = SCATTER_LOCK_STRIPED;
+  }
+  // there is no atomic += for classes: they get the striped locks instead
+  if (strategy == SCATTER_ATOMIC && !std::is_arithmetic<T>::value)
+    strategy = SCATTER_LOCK_STRIPED;
+  chosen = strategy;
+
+  if (chosen == SCATTER_PRIVATE_DENSE)
+  {
+    dense = new T*[threads];
+    dense[0] = target;
+  }
+  else if (chosen == SCATTER_PRIVATE_SPARSE)
+  {
+    sparse = new sparse_map<T>[threads];
+  }
+  else if (chosen == SCATTER_LOCK_STRIPED)
+  {
+    // enough stripes that two threads rarely want the same one
+    long stripes = (n + STRIPE_ENTRIES - 1) / STRIPE_ENTRIES;
+    num_locks = 1;
+    while (num_locks < 64 * threads && num_locks < stripes) num_locks *= 2;
+    locks = new omp_lock_t[num_locks];
+    for (long l = 0; l < num_locks; l++) omp_init_lock(&locks[l]);
+  }
+}
+
+template <class T>
+scatter_reducer<T>::~scatter_reducer()
+{
+  if (locks != NULL)
+  {
+    for (long l = 0; l < num_locks; l++) omp_destroy_lock(&locks[l]);
+    delete[] locks;
+  }
+  delete[] dense;
+  delete[] sparse;
+}
+
+template <class T>
+void scatter_reducer<T>::begin()
+{
+  int t = omp_get_thread_num();
+
+  if (omp_get_num_threads() > threads)
+  {
+    printf("scatter_reducer: built for %d threads, used by %d\n", threads,
+      omp_get_num_threads());
+    abort();
+  }
+
+  // every thread sets up its own copy, so that it is first touched (and
+  // placed in memory) by the thread that uses it
+  if (chosen == SCATTER_PRIVATE_DENSE && t > 0)
+  {
+    dense[t] = new T[n];
+    for (long i = 0; i < n; i++) dense[t][i] = T();
+  }
+  else if (chosen == SCATTER_PRIVATE_SPARSE)
+  {
+    sparse[t].init(1024);
+  }
+}
+
+template <class T>
+inline void scatter_reducer<T>::add(long i, const T& v)
+{
+  switch (chosen)
+  {
+    case SCATTER_PRIVATE_DENSE:
+      dense[omp_get_thread_num()][i] += v;
+      break;
+
+    case SCATTER_PRIVATE_SPARSE:
+      sparse[omp_get_thread_num()].add(i, v);
+      break;
+
+    case SCATTER_ATOMIC:
+      // only chosen for arithmetic T (see the constructor); the constexpr
+      // keeps the atomic from being compiled for other types
+      if constexpr (std::is_arithmetic<T>::value)
+      {
+        #pragma omp atomic
+        target[i] += v;
+      }
+      break;
+
+    case SCATTER_LOCK_STRIPED:
+    {
+      omp_lock_t* lock = &locks[(i / STRIPE_ENTRIES) & (num_locks - 1)];
+      omp_set_lock(lock);
+      target[i] += v;
+      omp_unset_lock(lock);
+      break;
+    }
+
+    default:
+      break;
+  }
+}
+
+template <class T>
+void scatter_reducer<T>::merge()
+{
+  int t = omp_get_thread_num();
+  int team = omp_get_num_threads();
+
+  // all adds done, and all private copies visible
+  #pragma omp barrier
+
+  if (chosen == SCATTER_PRIVATE_DENSE)
+  {
+    // round r adds copy a + 2^r into copy a, for every a that is a multiple
+    // of 2^(r + 1), with the entries divided over all threads
+    for (int stride = 1; stride < team; stride *= 2)
+    {
+      #pragma omp for schedule(static)
+      for (long i = 0; i < n; i++)
+        for (int a = 0; a + stride < team; a += 2 * stride)
+          dense[a][i] += dense[a + stride][i];
+    }
+    if (t > 0) delete[] dense[t];
+  }
+  else if (chosen == SCATTER_PRIVATE_SPARSE)
+  {
+    // the same tree, but every pair of maps is merged by one thread
+    for (int stride = 1; stride < team; stride *= 2)
+    {
+      if (t % (2 * stride) == 0 && t + stride < team)
+        sparse[t].merge_from(sparse[t + stride]);
+      #pragma omp barrier
+    }
+
+    // the entries of the last map are distinct, so they can be added to the
+    // shared array in parallel
+    const sparse_map<T>& root = sparse[0];
+    #pragma omp for schedule(static)
+    for (long s = 0; s < root.capacity; s++)
+      if (root.keys[s] != SPARSE_EMPTY) target[root.keys[s]] += root.values[s];
+
+    sparse[t].release();
+  }
+
+  #pragma omp barrier
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// the class of class-shared-array-openMP.cpp
+
+class c_test
+{
+  public:
+
+    long* dataset;
+    long res;
+
+    void initialize_dataset(long a_res)
+    {
+      res = a_res;
+      dataset = new long[res];
+      clear();
+    }
+    void clear() { memset(dataset, 0, res * sizeof(long)); }
+    void deallocate() { delete[] dataset; }
+};
+
+// a value that can not be updated with a single atomic
+struct count_sum
+{
+  long count;
+  double sum;
+
+  count_sum() : count(0), sum(0.) {}
+  count_sum(long c, double s) : count(c), sum(s) {}
+  count_sum& operator+=(const count_sum& o)
+  {
+    count += o.count;
+    sum += o.sum;
+    return *this;
+  }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+double histogram(c_test& C, const long* idx, long m, scatter_strategy strategy,
+  scatter_strategy* chosen)
+{
+  scatter_reducer<long> R(C.dataset, C.res, m, strategy);
+  double t0 = omp_get_wtime();
+
+  #pragma omp parallel
+  {
+    R.begin();
+    #pragma omp for schedule(static)
+    for (long k = 0; k < m; k++) R.add(idx[k], 1);
+    R.merge();
+  }
+
+  *chosen = R.strategy();
+  return omp_get_wtime() - t0;
+}
+
+int main(int argc, char** argv)
+{
+  int log2_m = argc > 1 ? atoi(argv[1]) : 24;
+  long m = 1L << log2_m;
+  const long sizes[] = { 1L << 10, 1L << 20, 1L << 26 };
+  const char* distributions[] = { "uniform", "skewed" };
+  const scatter_strategy order[] = { SCATTER_ATOMIC, SCATTER_PRIVATE_DENSE,
+    SCATTER_PRIVATE_SPARSE, SCATTER_LOCK_STRIPED, SCATTER_AUTO };
+  int threads = omp_get_max_threads();
+  int errors = 0;
+
+  long* idx = new long[m];
+
+  printf("%ld updates, %d threads, times in ms\n", m, threads);
+  printf("%10s %-8s %10s %10s %10s %10s %10s %8s\n", "entries",
+    "indices", "atomic", "dense", "sparse", "striped", "auto", "(picks)");
+
+  for (int s = 0; s < 3; s++)
+  {
+    long n = sizes[s];
+    c_test C;
+    C.initialize_dataset(n);
+    long* expected = new long[n];
+
+    for (int d = 0; d < 2; d++)
+    {
+      // skewed: n * u^8 for uniform u in [0, 1), which sends 42% of the
+      // updates to the first 0.1% of the entries
+      srand(42);
+      for (long k = 0; k < m; k++)
+      {
+        double u = (rand() + 0.5) / ((double) RAND_MAX + 1.);
+        idx[k] = d == 0 ? (long) (u * n) : (long) (n * pow(u, 8.));
+        if (idx[k] >= n) idx[k] = n - 1;
+      }
+
+      memset(expected, 0, n * sizeof(long));
+      for (long k = 0; k < m; k++) expected[idx[k]]++;
+
+      printf("%10ld %-8s", n, distributions[d]);
+      scatter_strategy chosen = SCATTER_AUTO;
+      for (int k = 0; k < 5; k++)
+      {
+        scatter_strategy st = order[k];
+        if (st == SCATTER_PRIVATE_DENSE && threads > 1
+          && (double) n * (threads - 1) * sizeof(long) > DENSE_BUDGET)
+        {
+          printf(" %10s", "-"); // the copies would not fit
+          continue;
+        }
+
+        C.clear();
+        double t = histogram(C, idx, m, st, &chosen);
+        bool ok = memcmp(C.dataset, expected, n * sizeof(long)) == 0;
+        errors += !ok;
+        printf(" %8.2f%s", 1e3 * t, ok ? "  " : "!!");
+      }
+      printf(" %8s\n", strategy_names[chosen]);
+    }
+
+    delete[] expected;
+    C.deallocate();
+  }
+
+  // a value type without an atomic add: per entry, the number of updates and
+  // the sum of their positions. Asking for SCATTER_ATOMIC gets lock striping.
+  long n = 1L << 16;
+  count_sum* stats = new count_sum[n];
+  scatter_reducer<count_sum> R(stats, n, m, SCATTER_ATOMIC);
+  #pragma omp parallel
+  {
+    R.begin();
+    #pragma omp for schedule(static)
+    for (long k = 0; k < m; k++) R.add(k % n, count_sum(1, (double) k));
+    R.merge();
+  }
+  long total = 0;
+  for (long i = 0; i < n; i++) total += stats[i].count;
+  printf("count_sum with %s: %ld updates counted %s\n",
+    strategy_names[R.strategy()], total, total == m ? "" : "WRONG");
+  errors += total != m;
+  delete[] stats;
+
+  delete[] idx;
+  return errors != 0;
+}
@@ -0,0 +1,204 @@
+// testing classes and dynamic array members: owning buffer versus view
+//
+// This is a follow-up to class-shared-array-openMP.cpp. There, c_test both
+// owns its array and is copied into every thread with firstprivate. Since a
+// destructor would then run once for every copy, the memory can only be
+// released by calling deallocate() by hand.
+//
+// Here the two roles are split over two classes:
+//
+//   long_buffer  owns the memory. It cannot be copied, only moved, and its
+//                destructor releases the memory exactly once (RAII).
+//   long_view    a pointer plus a length and nothing else. It is trivially
+//                copyable (checked with a static_assert below), so that a
+//                firstprivate copy is just two words being copied, and it has
+//                no destructor that could release anything.
+//
+// Classes that get copied into threads or tasks (c_test below) hold a view,
+// while the buffer lives in the enclosing scope, which must outlive all the
+// copies.
+//
+// An obvious alternative is a std::shared_ptr, which also releases the memory
+// exactly once. But every copy of a shared_ptr increments (and every
+// destruction decrements) an atomic reference count in a control block that
+// is shared by all threads, so that thousands of firstprivate copies all
+// contend for the same cache line. The microbenchmark at the end of main
+// compares the cost of both for parallel regions and for tasks.
+//
+// compiled with g++ class-shared-array-view-openMP.cpp -fopenmp -O2 -Wall
+
+#include <stdio.h>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <omp.h>
+
+#define NUM_REGIONS 10000
+#define NUM_TASKS 100000
+
+// a non-owning view on an array of longs
+class long_view
+{
+  public:
+
+    long* data;
+    long n;
+
+    long& operator[](long i) const { return data[i]; }
+    long size() const { return n; }
+};
+
+static_assert(std::is_trivially_copyable<long_view>::value,
+  "long_view must stay trivially copyable to be cheap to firstprivate");
+
+// the owner of an array of longs
+class long_buffer
+{
+  public:
+
+    explicit long_buffer(long n_arg) : data(new long[n_arg]), n(n_arg) {}
+    ~long_buffer() { delete[] data; } // runs once, for the single owner
+
+    // copying would lead to a double delete, so only moving is allowed
+    long_buffer(const long_buffer&) = delete;
+    long_buffer& operator=(const long_buffer&) = delete;
+    long_buffer(long_buffer&& other) noexcept : data(other.data), n(other.n)
+    {
+      other.data = NULL;
+      other.n = 0;
+    }
+    long_buffer& operator=(long_buffer&& other) noexcept
+    {
+      std::swap(data, other.data);
+      std::swap(n, other.n);
+      return *this;
+    }
+
+    long_view view() const { long_view v; v.data = data; v.n = n; return v; }
+
+  protected:
+
+    long* data;
+    long n;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the class from class-shared-array-openMP.cpp, now holding a view on the
+// dataset instead of owning it. No deallocate() is needed anymore.
+class c_test
+{
+  public:
+
+    long_view dataset;
+
+    void attach(const long_buffer& buffer) { dataset = buffer.view(); }
+};
+
+// the shared_ptr based alternative, for the benchmark
+class c_test_shared
+{
+  public:
+
+    std::shared_ptr<long[]> dataset;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// time NUM_REGIONS parallel regions that each get a firstprivate copy of C
+template <class T>
+double time_regions(const T& C_in)
+{
+  T C = C_in;
+  double t0 = omp_get_wtime();
+
+  for (int r = 0; r < NUM_REGIONS; r++)
+  {
+    #pragma omp parallel firstprivate(C)
+    {
+      C.dataset[omp_get_thread_num()] += 1;
+    }
+  }
+
+  return (omp_get_wtime() - t0) / NUM_REGIONS;
+}
+
+// time NUM_TASKS tasks that each get a firstprivate copy of C
+template <class T>
+double time_tasks(const T& C_in)
+{
+  T C = C_in;
+  double t0 = omp_get_wtime();
+
+  #pragma omp parallel
+  #pragma omp single
+  {
+    for (int k = 0; k < NUM_TASKS; k++)
+    {
+      #pragma omp task firstprivate(C)
+      {
+        C.dataset[omp_get_thread_num()] += 1;
+      }
+    }
+  }
+
+  return (omp_get_wtime() - t0) / NUM_TASKS;
+}
+
+int main()
+{
+  int res = 10;
+  int max_threads = omp_get_max_threads();
+
+  // the owner, which outlives every copy of C below
+  long_buffer buffer(res);
+  long_view all = buffer.view();
+  for (int i = 0; i < res; i++) all[i] = i;
+
+  c_test C;
+  C.attach(buffer);
+  long* dataset2 = new long[res];
+
+  // the same loop as in class-shared-array-openMP.cpp. Each thread gets its
+  // own copy of the view, but all views point to the same memory.
+  #pragma omp parallel for firstprivate(C)
+  for (int i = 0; i < res; i++)
+  {
+    int my_ID = omp_get_thread_num();
+    printf("i = %i, my_ID = %i, dataset pointer = %p\n", i, my_ID, &C.dataset[i]); fflush(stdout);
+    dataset2[i] = C.dataset[i];
+    C.dataset[i] = my_ID;
+  }
+
+  for (int i = 0; i < res; i++)
+  {
+    printf("dataset2: %i, %li\n", i, dataset2[i]);
+  }
+
+  for (int i = 0; i < res; i++)
+  {
+    printf("dataset: %i, %li\n", i, C.dataset[i]);
+  }
+
+  delete[] dataset2;
+
+  // microbenchmark: per-region and per-task cost of the firstprivate copy.
+  // The arrays have one entry per thread for the bodies to write to.
+  long_buffer bench_buffer(max_threads);
+  c_test C_view;
+  C_view.attach(bench_buffer);
+  for (int t = 0; t < max_threads; t++) C_view.dataset[t] = 0;
+
+  c_test_shared C_shared;
+  C_shared.dataset = std::shared_ptr<long[]>(new long[max_threads]());
+
+  printf("\nthreads: %i\n", max_threads);
+  printf("%-12s %16s %16s\n", "", "per region", "per task");
+  printf("%-12s %13.3f us %13.3f us\n", "view",
+    time_regions(C_view) * 1e6, time_tasks(C_view) * 1e6);
+  printf("%-12s %13.3f us %13.3f us\n", "shared_ptr",
+    time_regions(C_shared) * 1e6, time_tasks(C_shared) * 1e6);
+
+  // buffer and bench_buffer release their memory here, exactly once
+  return 0;
+}
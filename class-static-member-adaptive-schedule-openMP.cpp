@@ -0,0 +1,462 @@
+// testing parallel for loops that pick their own schedule
+//
+// motivation: the parallel for loops of class-static-member-openMP.cpp and
+// class-shared-array-openMP.cpp use the default schedule, which with GCC is
+// static: every thread gets one contiguous block of about n / threads
+// iterations. That is the cheapest schedule when all iterations cost the
+// same, and a bad one when they do not, as the thread with the expensive
+// block keeps all others waiting at the end of the loop. dynamic and guided
+// balance the load, at the price of handing out chunks while the loop runs,
+// and the right chunk size depends on what an iteration costs, which is
+// rarely known when the loop is written.
+//
+// Here a loop is written as
+//
+//   ADAPTIVE_FOR(n, [&](long i) { ... });
+//
+// and every ADAPTIVE_FOR in the source is a 'site' (its file and line).
+// Per site, number of threads and order of magnitude of n, the first calls
+// run the loop with schedule(static) and time the share of every thread. If
+// the shares took about equally long, static stays. Otherwise, the mean cost
+// of an iteration gives the smallest chunk that still takes about a
+// microsecond of work (so that handing it out is cheap in comparison), and
+// the next calls try dynamic with 1, 4 and 16 times that chunk and guided
+// with it. From then on the site uses the fastest of them, set through
+// omp_set_schedule and schedule(runtime).
+//
+// The choices are written to adaptive-schedule.txt (or the file named by
+// ADAPTIVE_SCHEDULE_FILE) at exit, and read back at the next start, so that
+// a program pays for the tuning only once. ADAPTIVE_SCHEDULE_RETUNE=1
+// ignores the file.
+//
+// The loop body is copied into every thread, so a body that captures a class
+// by value, as [=] or [C], gets the firstprivate(C) of
+// class-shared-array-openMP.cpp.
+//
+// main() runs the loops of both snippets through ADAPTIVE_FOR, and then
+// benchmarks the report_number loop with extra work per iteration that is
+// uniform, grows with i, or is heavy for a few random i, against fixed
+// schedules.
+//
+// compiled with g++ class-static-member-adaptive-schedule-openMP.cpp -fopenmp -O2 -Wall
+// run with ./a.out [res]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <map>
+#include <omp.h>
+
+#define TRIALS 2 // calls per candidate schedule
+#define MAX_CANDIDATES 5
+#define MIN_CHUNK_SECONDS 1e-6 // the least work per dynamic chunk
+#define BALANCED 0.05 // static stays if the slowest share is at most this
+  // much above the mean share
+
+#define ADAPTIVE_STRINGIFY(x) #x
+#define ADAPTIVE_SITE(line) __FILE__ ":" ADAPTIVE_STRINGIFY(line)
+#define ADAPTIVE_FOR(n, body) adaptive_for(ADAPTIVE_SITE(__LINE__), n, body)
+
+////////////////////////////////////////////////////////////////////////////////
+// the tuning state of a site
+
+typedef struct schedule_choice
+{
+  omp_sched_t kind;
+  int chunk;
+} schedule_choice;
+
+class loop_tuning
+{
+  public:
+
+    bool decided;
+    schedule_choice choice;
+
+    // while not decided
+    int calls;
+    int num_candidates;
+    schedule_choice candidates[MAX_CANDIDATES];
+    double best_time[MAX_CANDIDATES];
+
+    loop_tuning()
+    {
+      decided = false;
+      choice.kind = omp_sched_static;
+      choice.chunk = 0;
+      calls = 0;
+      num_candidates = 1;
+      candidates[0] = choice;
+      best_time[0] = 1e30;
+    }
+};
+
+static std::map<std::string, loop_tuning> tuning_table;
+static bool tuning_loaded = false;
+
+const char* schedule_name(omp_sched_t kind)
+{
+  switch (kind)
+  {
+    case omp_sched_static: return "static";
+    case omp_sched_dynamic: return "dynamic";
+    case omp_sched_guided: return "guided";
+    default: return "auto";
+  }
+}
+
+const char* schedule_file()
+{
+  const char* filename = getenv("ADAPTIVE_SCHEDULE_FILE");
+  return filename != NULL ? filename : "adaptive-schedule.txt";
+}
+
+// one line per decided site: <key> <kind> <chunk>
+void save_tuning()
+{
+  FILE* f = fopen(schedule_file(), "w");
+  if (f == NULL) { perror(schedule_file()); return; }
+
+  std::map<std::string, loop_tuning>::iterator it;
+  for (it = tuning_table.begin(); it != tuning_table.end(); ++it)
+  {
+    if (!it->second.decided) continue;
+    fprintf(f, "%s %s %d\n", it->first.c_str(),
+      schedule_name(it->second.choice.kind), it->second.choice.chunk);
+  }
+  fclose(f);
+}
+
+void load_tuning()
+{
+  const char* retune = getenv("ADAPTIVE_SCHEDULE_RETUNE");
+  char key[512], kind[16];
+  int chunk;
+
+  tuning_loaded = true;
+  atexit(save_tuning);
+  if (retune != NULL && atoi(retune) != 0) return;
+
+  FILE* f = fopen(schedule_file(), "r");
+  if (f == NULL) return; // nothing tuned yet
+
+  while (fscanf(f, "%511s %15s %d", key, kind, &chunk) == 3)
+  {
+    loop_tuning& t = tuning_table[key];
+    t.decided = true;
+    t.choice.kind = std::string(kind) == "dynamic" ? omp_sched_dynamic
+      : std::string(kind) == "guided" ? omp_sched_guided : omp_sched_static;
+    t.choice.chunk = chunk;
+  }
+  fclose(f);
+}
+
+// the site, the number of threads and the order of magnitude of n (in powers
+// of 2): the best schedule for a loop of 1000 iterations need not be the best
+// for 10^8, nor for 4 threads the best for 64.
+std::string tuning_key(const char* site, long n, int threads)
+{
+  char key[512];
+  int log2_n = 0;
+
+  while ((1L << (log2_n + 1)) <= n) log2_n++;
+  snprintf(key, sizeof(key), "%s:t%d:n2^%d", site, threads, log2_n);
+  // the file holds the key as one word
+  for (char* c = key; *c != '\0'; c++) if (*c == ' ') *c = '_';
+  return std::string(key);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// running and tuning the loop
+
+// run body(i) for i = 0 ... n - 1 with the schedule set by omp_set_schedule.
+// If share_time is not NULL, every thread stores how long its share took.
+template <class Body>
+void run_loop(long n, const Body& body, double* share_time)
+{
+  #pragma omp parallel
+  {
+    Body b = body; // every thread its own copy, as firstprivate would do
+    double t0 = omp_get_wtime();
+
+    #pragma omp for schedule(runtime) nowait
+    for (long i = 0; i < n; i++)
+    {
+      b(i);
+    }
+
+    if (share_time != NULL)
+      share_time[omp_get_thread_num()] = omp_get_wtime() - t0;
+  }
+}
+
+// after the static trials: keep static if the shares are balanced, otherwise
+// set up the dynamic and guided candidates
+void plan_candidates(loop_tuning& t, long n, int threads,
+  const double* share_time)
+{
+  double sum = 0., slowest = 0.;
+
+  for (int k = 0; k < threads; k++)
+  {
+    sum += share_time[k];
+    if (share_time[k] > slowest) slowest = share_time[k];
+  }
+
+  if (slowest - sum / threads <= BALANCED * slowest || n < 2 * threads)
+  {
+    t.decided = true;
+    return;
+  }
+
+  // the smallest chunk with about MIN_CHUNK_SECONDS of work, but at least a
+  // few chunks per thread
+  double cost = sum / n;
+  long chunk = (long) (MIN_CHUNK_SECONDS / cost) + 1;
+  long max_chunk = n / (4 * threads) > 0 ? n / (4 * threads) : 1;
+  if (chunk > max_chunk) chunk = max_chunk;
+
+  long chunks[3] = { chunk, 4 * chunk, 16 * chunk };
+  for (int c = 0; c < 3; c++)
+  {
+    schedule_choice s = { omp_sched_dynamic,
+      (int) (chunks[c] < max_chunk ? chunks[c] : max_chunk) };
+    t.candidates[t.num_candidates] = s;
+    t.best_time[t.num_candidates++] = 1e30;
+  }
+  schedule_choice g = { omp_sched_guided, (int) chunk };
+  t.candidates[t.num_candidates] = g;
+  t.best_time[t.num_candidates++] = 1e30;
+}
+
+template <class Body>
+void adaptive_for(const char* site, long n, const Body& body)
+{
+  int threads = omp_get_max_threads();
+  omp_sched_t old_kind;
+  int old_chunk;
+
+  if (!tuning_loaded) load_tuning();
+  loop_tuning& t = tuning_table[tuning_key(site, n, threads)];
+  if (threads == 1) t.decided = true; // nothing to balance
+
+  omp_get_schedule(&old_kind, &old_chunk);
+
+  if (t.decided)
+  {
+    omp_set_schedule(t.choice.kind, t.choice.chunk);
+    run_loop(n, body, (double*) NULL);
+  }
+  else
+  {
+    int c = t.calls / TRIALS; // the candidate to try in this call
+    double* share_time = new double[threads]();
+
+    omp_set_schedule(t.candidates[c].kind, t.candidates[c].chunk);
+    double t0 = omp_get_wtime();
+    run_loop(n, body, c == 0 ? share_time : (double*) NULL);
+    double time = omp_get_wtime() - t0;
+
+    if (time < t.best_time[c]) t.best_time[c] = time;
+    t.calls++;
+
+    if (t.calls == TRIALS) plan_candidates(t, n, threads, share_time);
+    if (!t.decided && t.calls == t.num_candidates * TRIALS)
+    {
+      int best = 0;
+      for (int k = 1; k < t.num_candidates; k++)
+        if (t.best_time[k] < t.best_time[best]) best = k;
+      t.choice = t.candidates[best];
+      t.decided = true;
+    }
+    delete[] share_time;
+  }
+
+  omp_set_schedule(old_kind, old_chunk);
+}
+
+void print_tuning()
+{
+  std::map<std::string, loop_tuning>::iterator it;
+
+  for (it = tuning_table.begin(); it != tuning_table.end(); ++it)
+  {
+    const loop_tuning& t = it->second;
+    if (t.decided)
+      printf("  %-60s %s,%d\n", it->first.c_str(), schedule_name(t.choice.kind),
+        t.choice.chunk);
+    else
+      printf("  %-60s (still tuning)\n", it->first.c_str());
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// the classes of class-static-member-openMP.cpp and class-shared-array-openMP.cpp
+
+class c_test
+{
+  public:
+
+    static void initialize_dataset(long res_arg);
+    static void deallocate_statics();
+
+    long report_number(long i) { return dataset[i]; }
+
+    static long* dataset;
+
+  protected:
+
+    static long res;
+};
+
+long* c_test::dataset = NULL;
+long c_test::res = 0;
+
+void c_test::initialize_dataset(long res_arg)
+{
+  res = res_arg;
+  dataset = new long[res];
+
+  ADAPTIVE_FOR(res, [](long i) { dataset[i] = i; });
+}
+
+void c_test::deallocate_statics()
+{
+  if (dataset != NULL) { delete[] dataset; dataset = NULL; }
+}
+
+class c_test_shared
+{
+  public:
+    long* dataset;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// the benchmark
+
+// about w units of work that the compiler can not remove
+static inline long spin(long x, long w)
+{
+  for (long k = 0; k < w; k++) x = x * 6364136223846793005L + 1442695040888963407L;
+  return x;
+}
+
+typedef struct workload
+{
+  const char* name;
+  long* work; // per iteration
+} workload;
+
+double time_fixed(omp_sched_t kind, int chunk, long res, const long* work,
+  long* dataset2, int repetitions)
+{
+  double best = 1e30;
+
+  omp_set_schedule(kind, chunk);
+  for (int r = 0; r < repetitions; r++)
+  {
+    double t0 = omp_get_wtime();
+    #pragma omp parallel for schedule(runtime)
+    for (long i = 0; i < res; i++)
+    {
+      c_test C;
+      dataset2[i] = spin(C.report_number(i), work[i]);
+    }
+    double t = omp_get_wtime() - t0;
+    if (t < best) best = t;
+  }
+  return best;
+}
+
+int main(int argc, char** argv)
+{
+  long res = argc > 1 ? atol(argv[1]) : 1000000;
+  const int repetitions = 5;
+  long i;
+
+  printf("threads: %d\n", omp_get_max_threads());
+
+  // the loops of the two snippets
+  c_test::initialize_dataset(res);
+  long* dataset2 = new long[res];
+
+  ADAPTIVE_FOR(res, [&](long i)
+  {
+    c_test C; // create a local instance of the class
+    dataset2[i] = C.report_number(i);
+  });
+
+  c_test_shared S;
+  S.dataset = new long[res];
+  for (i = 0; i < res; i++) S.dataset[i] = i;
+
+  ADAPTIVE_FOR(res, [=](long i)
+  {
+    // S is captured by value: every thread has its own copy, pointing to the
+    // same array
+    dataset2[i] = S.dataset[i];
+    S.dataset[i] = omp_get_thread_num();
+  });
+
+  // the benchmark: report_number plus extra work per iteration
+  workload workloads[3] = { { "uniform", new long[res] },
+    { "increasing", new long[res] }, { "heavy tail", new long[res] } };
+  srand(42);
+  for (i = 0; i < res; i++)
+  {
+    workloads[0].work[i] = 20;
+    workloads[1].work[i] = 40 * i / res;
+    workloads[2].work[i] = rand() % 100 == 0 ? 2000 : 1; // about 20 on average
+  }
+
+  schedule_choice fixed[5] = { { omp_sched_static, 0 },
+    { omp_sched_static, 1 }, { omp_sched_dynamic, 1 },
+    { omp_sched_dynamic, 64 }, { omp_sched_guided, 1 } };
+
+  printf("\n%-12s %12s %12s %12s %12s %12s %12s %8s\n", "workload",
+    "static", "static,1", "dynamic,1", "dynamic,64", "guided", "adaptive",
+    "tuning");
+  for (int w = 0; w < 3; w++)
+  {
+    const long* work = workloads[w].work;
+    printf("%-12s", workloads[w].name);
+    for (int s = 0; s < 5; s++)
+      printf(" %10.3fms", 1e3 * time_fixed(fixed[s].kind, fixed[s].chunk, res,
+        work, dataset2, repetitions));
+
+    // the adaptive loop, first until it has decided, then timed like the
+    // fixed schedules. One site per workload, as every workload is a
+    // different loop.
+    std::string site = std::string("benchmark:") + workloads[w].name;
+    auto body = [=](long i)
+    {
+      c_test C;
+      dataset2[i] = spin(C.report_number(i), work[i]);
+    };
+    int tuning_calls = 0;
+    while (!tuning_table[tuning_key(site.c_str(), res, omp_get_max_threads())].decided)
+    {
+      adaptive_for(site.c_str(), res, body);
+      tuning_calls++;
+    }
+
+    double best = 1e30;
+    for (int r = 0; r < repetitions; r++)
+    {
+      double t0 = omp_get_wtime();
+      adaptive_for(site.c_str(), res, body);
+      double t = omp_get_wtime() - t0;
+      if (t < best) best = t;
+    }
+    printf(" %10.3fms %8d\n", 1e3 * best, tuning_calls);
+  }
+
+  printf("\nschedules chosen (saved to %s):\n", schedule_file());
+  print_tuning();
+
+  for (int w = 0; w < 3; w++) delete[] workloads[w].work;
+  delete[] S.dataset;
+  delete[] dataset2;
+  c_test::deallocate_statics();
+  return 0;
+}
@@ -0,0 +1,497 @@
+// testing per-thread arenas for the scratch memory of local class instances
+//
+// motivation: class-static-member-openMP.cpp creates a local instance
+// 'c_test C' in every iteration of its parallel for loop. That costs nothing
+// as long as c_test only holds a pointer to the static dataset, but once an
+// instance owns some scratch memory of its own (a std::vector, say), every
+// iteration allocates and frees, and all threads end up in malloc. glibc
+// serves threads from a limited number of arenas with a lock each, so with
+// enough threads the loop spends its time waiting in malloc and free.
+//
+// Scratch memory of a loop iteration has a simple lifetime: it is all gone
+// by the end of the iteration. A per-thread bump arena exploits that: every
+// thread owns a list of large chunks, allocating is moving a pointer forward
+// in the current chunk, and freeing everything allocated since some point is
+// moving the pointer back. Nothing is shared between threads, so there are no
+// locks and no atomics.
+//
+//   thread_arena::local()        the arena of the calling thread
+//   arena_scope scope;           everything allocated from the thread's arena
+//                                while 'scope' lives is released when it goes
+//                                out of scope (per iteration or per region)
+//   arena_allocator<T>           an allocator for std::vector and the other
+//                                containers, that allocates from the arena
+//
+// Blocks of up to 4 KiB that are freed within a scope (as a growing vector
+// frees its old storage) go onto a free list per power of two size, and are
+// reused before the bump pointer moves on. That keeps a vector that grows
+// element by element from using twice the memory it needs.
+//
+// Containers using arena_allocator must not outlive the scope in which they
+// were filled, and must not be passed to another thread, whose arena is
+// different.
+//
+// main() runs the report_number loop with an instance that collects a window
+// of the dataset in a scratch vector each iteration, and times it with
+// std::allocator (new), malloc, a jemalloc-style per-thread cache of size
+// classes, and the arena, at 1 to 128 threads.
+//
+// compiled with g++ class-static-member-arena-openMP.cpp -fopenmp -O2 -Wall
+// run with ./a.out [iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <vector>
+#include <new>
+#include <algorithm>
+#include <omp.h>
+
+#define ARENA_CHUNK_BYTES (1 << 20)
+#define ARENA_NUM_CLASSES 9 // free lists for 16, 32, ..., 4096 bytes
+#define ARENA_MIN_CLASS 16
+
+////////////////////////////////////////////////////////////////////////////////
+// the arena
+
+class thread_arena
+{
+  public:
+
+    typedef struct marker
+    {
+      size_t chunk;
+      size_t offset;
+    } marker;
+
+    thread_arena();
+    ~thread_arena();
+
+    void* allocate(size_t bytes, size_t align);
+    void deallocate(void* p, size_t bytes, size_t align);
+
+    marker mark() const { marker m = { current, offset }; return m; }
+    void release(marker m);
+    void reset() { marker m = { 0, 0 }; release(m); }
+
+    size_t capacity() const;
+
+    static thread_arena& local();
+
+  protected:
+
+    std::vector<char*> chunks;
+    std::vector<size_t> chunk_bytes;
+    size_t current; // the chunk allocated from
+    size_t offset;  // the first free byte in it
+    void* free_list[ARENA_NUM_CLASSES];
+
+    void* bump(size_t bytes, size_t align);
+    static int size_class(size_t bytes);
+    static char* new_chunk(size_t bytes);
+    static size_t aligned_offset(const char* base, size_t offset, size_t align);
+};
+
+thread_arena::thread_arena()
+{
+  current = 0;
+  offset = 0;
+  for (int k = 0; k < ARENA_NUM_CLASSES; k++) free_list[k] = NULL;
+  chunks.push_back(new_chunk(ARENA_CHUNK_BYTES));
+  chunk_bytes.push_back(ARENA_CHUNK_BYTES);
+}
+
+thread_arena::~thread_arena()
+{
+  for (size_t k = 0; k < chunks.size(); k++) free(chunks[k]);
+}
+
+thread_arena& thread_arena::local()
+{
+  static thread_local thread_arena arena;
+  return arena;
+}
+
+size_t thread_arena::capacity() const
+{
+  size_t bytes = 0;
+  for (size_t k = 0; k < chunk_bytes.size(); k++) bytes += chunk_bytes[k];
+  return bytes;
+}
+
+// the free list for a block, -1 if it is too large to be pooled
+int thread_arena::size_class(size_t bytes)
+{
+  int k = 0;
+  size_t size = ARENA_MIN_CLASS;
+
+  while (size < bytes) { size *= 2; k++; }
+  return k < ARENA_NUM_CLASSES ? k : -1;
+}
+
+char* thread_arena::new_chunk(size_t bytes)
+{
+  char* p = (char*) aligned_alloc(64, bytes);
+  if (p == NULL) throw std::bad_alloc();
+  return p;
+}
+
+// the first offset at or after offset in the chunk at base where an aligned
+// block can start. Chunks are only 64-byte aligned, so larger alignments
+// depend on the address of the chunk.
+size_t thread_arena::aligned_offset(const char* base, size_t offset, size_t align)
+{
+  uintptr_t a = ((uintptr_t) base + offset + align - 1) & ~(uintptr_t) (align - 1);
+  return a - (uintptr_t) base;
+}
+
+void* thread_arena::bump(size_t bytes, size_t align)
+{
+  size_t start = aligned_offset(chunks[current], offset, align);
+
+  if (start + bytes > chunk_bytes[current])
+  {
+    // move on to the next chunk, and add one (large enough for this block)
+    // if the next one is missing or too small
+    size_t needed = bytes + align;
+    current++;
+    if (current == chunks.size() || chunk_bytes[current] < needed)
+    {
+      size_t size = std::max((size_t) ARENA_CHUNK_BYTES,
+        (needed + 63) & ~(size_t) 63);
+      chunks.insert(chunks.begin() + current, new_chunk(size));
+      chunk_bytes.insert(chunk_bytes.begin() + current, size);
+    }
+    start = aligned_offset(chunks[current], 0, align);
+  }
+
+  offset = start + bytes;
+  return chunks[current] + start;
+}
+
+void* thread_arena::allocate(size_t bytes, size_t align)
+{
+  int k = align <= ARENA_MIN_CLASS ? size_class(bytes) : -1;
+
+  if (k < 0) return bump(bytes, align);
+
+  if (free_list[k] != NULL)
+  {
+    void* p = free_list[k];
+    free_list[k] = *(void**) p;
+    return p;
+  }
+  return bump((size_t) ARENA_MIN_CLASS << k, ARENA_MIN_CLASS);
+}
+
+void thread_arena::deallocate(void* p, size_t bytes, size_t align)
+{
+  // as in allocate: over-aligned blocks were bumped for exactly their size,
+  // not for a whole size class, so they can not go onto a free list
+  int k = align <= ARENA_MIN_CLASS ? size_class(bytes) : -1;
+
+  // large and over-aligned blocks stay where they are until the scope ends
+  if (k < 0) return;
+
+  *(void**) p = free_list[k];
+  free_list[k] = p;
+}
+
+void thread_arena::release(marker m)
+{
+  current = m.chunk;
+  offset = m.offset;
+  // blocks on the free lists may lie beyond the marker, so the lists go.
+  // Listed blocks before the marker stay unused until an enclosing scope (or
+  // reset) releases them.
+  for (int k = 0; k < ARENA_NUM_CLASSES; k++) free_list[k] = NULL;
+}
+
+// releases at the end of its scope what was allocated from the thread's arena
+// since its construction
+class arena_scope
+{
+  public:
+    arena_scope() : arena(thread_arena::local()), m(arena.mark()) {}
+    ~arena_scope() { arena.release(m); }
+
+  protected:
+    thread_arena& arena;
+    thread_arena::marker m;
+};
+
+template <class T>
+class arena_allocator
+{
+  public:
+
+    typedef T value_type;
+
+    thread_arena* arena;
+
+    arena_allocator() : arena(&thread_arena::local()) {}
+    template <class U>
+    arena_allocator(const arena_allocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(size_t n)
+    {
+      return (T*) arena->allocate(n * sizeof(T), alignof(T));
+    }
+    void deallocate(T* p, size_t n)
+    {
+      arena->deallocate(p, n * sizeof(T), alignof(T));
+    }
+};
+
+template <class T, class U>
+bool operator==(const arena_allocator<T>& a, const arena_allocator<U>& b)
+{
+  return a.arena == b.arena;
+}
+
+template <class T, class U>
+bool operator!=(const arena_allocator<T>& a, const arena_allocator<U>& b)
+{
+  return a.arena != b.arena;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// what the arena is compared with
+
+template <class T>
+class malloc_allocator
+{
+  public:
+    typedef T value_type;
+    malloc_allocator() {}
+    template <class U> malloc_allocator(const malloc_allocator<U>&) {}
+    T* allocate(size_t n)
+    {
+      T* p = (T*) malloc(n * sizeof(T));
+      if (p == NULL) throw std::bad_alloc();
+      return p;
+    }
+    void deallocate(T* p, size_t) { free(p); }
+};
+
+template <class T, class U>
+bool operator==(const malloc_allocator<T>&, const malloc_allocator<U>&) { return true; }
+template <class T, class U>
+bool operator!=(const malloc_allocator<T>&, const malloc_allocator<U>&) { return false; }
+
+// a per-thread cache of freed blocks in size classes, as jemalloc and
+// tcmalloc keep one in front of their shared heaps. The classes are spaced
+// 16 bytes apart up to 128 bytes, and four per doubling above that, up to
+// 16 KiB; larger blocks go to malloc directly.
+#define CACHE_NUM_CLASSES 36
+#define CACHE_BLOCKS_PER_CLASS 64
+
+class size_class_cache
+{
+  public:
+
+    size_t class_size[CACHE_NUM_CLASSES];
+
+    size_class_cache()
+    {
+      int k = 0;
+      for (size_t s = 16; s <= 128; s += 16) class_size[k++] = s;
+      for (size_t base = 128; k < CACHE_NUM_CLASSES; base *= 2)
+        for (int q = 1; q <= 4 && k < CACHE_NUM_CLASSES; q++)
+          class_size[k++] = base + q * base / 4;
+      for (k = 0; k < CACHE_NUM_CLASSES; k++) count[k] = 0;
+    }
+
+    ~size_class_cache()
+    {
+      for (int k = 0; k < CACHE_NUM_CLASSES; k++)
+        for (int b = 0; b < count[k]; b++) free(cached[k][b]);
+    }
+
+    static size_class_cache& local()
+    {
+      static thread_local size_class_cache cache;
+      return cache;
+    }
+
+    void* allocate(size_t bytes)
+    {
+      int k = size_class(bytes);
+      if (k < 0) return malloc(bytes);
+      if (count[k] > 0) return cached[k][--count[k]];
+      return malloc(class_size[k]);
+    }
+
+    void deallocate(void* p, size_t bytes)
+    {
+      int k = size_class(bytes);
+      if (k >= 0 && count[k] < CACHE_BLOCKS_PER_CLASS) cached[k][count[k]++] = p;
+      else free(p);
+    }
+
+  protected:
+
+    void* cached[CACHE_NUM_CLASSES][CACHE_BLOCKS_PER_CLASS];
+    int count[CACHE_NUM_CLASSES];
+
+    int size_class(size_t bytes) const
+    {
+      const size_t* c = std::lower_bound(class_size,
+        class_size + CACHE_NUM_CLASSES, bytes);
+      return c == class_size + CACHE_NUM_CLASSES ? -1 : (int) (c - class_size);
+    }
+};
+
+template <class T>
+class size_class_allocator
+{
+  public:
+    typedef T value_type;
+    size_class_allocator() {}
+    template <class U> size_class_allocator(const size_class_allocator<U>&) {}
+    T* allocate(size_t n)
+    {
+      T* p = (T*) size_class_cache::local().allocate(n * sizeof(T));
+      if (p == NULL) throw std::bad_alloc();
+      return p;
+    }
+    void deallocate(T* p, size_t n)
+    {
+      size_class_cache::local().deallocate(p, n * sizeof(T));
+    }
+};
+
+template <class T, class U>
+bool operator==(const size_class_allocator<T>&, const size_class_allocator<U>&) { return true; }
+template <class T, class U>
+bool operator!=(const size_class_allocator<T>&, const size_class_allocator<U>&) { return false; }
+
+////////////////////////////////////////////////////////////////////////////////
+// the class of class-static-member-openMP.cpp, and a version with scratch
+
+class c_test
+{
+  public:
+
+    static void initialize_dataset(long res_arg);
+    static void deallocate_statics();
+
+    long report_number(long i) { return dataset[i]; }
+
+    static long* dataset;
+    static long res;
+};
+
+long* c_test::dataset = NULL;
+long c_test::res = 0;
+
+void c_test::initialize_dataset(long res_arg)
+{
+  res = res_arg;
+  dataset = new long[res];
+
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < res; i++) dataset[i] = i;
+}
+
+void c_test::deallocate_statics()
+{
+  if (dataset != NULL) { delete[] dataset; dataset = NULL; }
+}
+
+// collects a window of the dataset in its own scratch vector, which grows
+// element by element as such buffers tend to do
+template <class Alloc>
+class c_test_scratch : public c_test
+{
+  public:
+
+    std::vector<long, Alloc> scratch;
+
+    long report_window(long i, long width)
+    {
+      long sum = 0;
+      for (long k = 0; k < width; k++) scratch.push_back(dataset[(i + k) % res]);
+      for (size_t k = 0; k < scratch.size(); k++) sum += scratch[k];
+      return sum;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// every iteration makes a local instance, as in class-static-member-openMP.cpp,
+// whose scratch is gone at the end of the iteration
+template <class Alloc, bool use_scope>
+double run_loop(long iterations, long* dataset2)
+{
+  double t0 = omp_get_wtime();
+
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < iterations; i++)
+  {
+    if (use_scope)
+    {
+      arena_scope scope; // declared first, so that it is released last
+      c_test_scratch<Alloc> C;
+      dataset2[i] = C.report_window(i % c_test::res, 16 + i % 241);
+    }
+    else
+    {
+      c_test_scratch<Alloc> C;
+      dataset2[i] = C.report_window(i % c_test::res, 16 + i % 241);
+    }
+  }
+
+  return omp_get_wtime() - t0;
+}
+
+int main(int argc, char** argv)
+{
+  long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+  long res = 100000;
+  long* dataset2 = new long[iterations];
+  long* check = new long[iterations];
+
+  c_test::initialize_dataset(res);
+
+  printf("%ld iterations, %d hardware threads, times in ns per iteration\n",
+    iterations, omp_get_num_procs());
+  printf("%8s %14s %14s %14s %14s\n", "threads", "new", "malloc",
+    "size classes", "arena");
+
+  for (int threads = 1; threads <= 128; threads *= 2)
+  {
+    double t[4];
+
+    omp_set_num_threads(threads);
+
+    // the first run of every allocator warms up its caches and chunks
+    run_loop<std::allocator<long>, false>(iterations, check);
+    t[0] = run_loop<std::allocator<long>, false>(iterations, check);
+    run_loop<malloc_allocator<long>, false>(iterations, dataset2);
+    t[1] = run_loop<malloc_allocator<long>, false>(iterations, dataset2);
+    run_loop<size_class_allocator<long>, false>(iterations, dataset2);
+    t[2] = run_loop<size_class_allocator<long>, false>(iterations, dataset2);
+    run_loop<arena_allocator<long>, true>(iterations, dataset2);
+    t[3] = run_loop<arena_allocator<long>, true>(iterations, dataset2);
+
+    if (!std::equal(dataset2, dataset2 + iterations, check))
+    {
+      printf("results differ\n");
+      return 1;
+    }
+
+    printf("%8d", threads);
+    for (int k = 0; k < 4; k++) printf(" %14.1f", 1e9 * t[k] / iterations);
+    printf("\n");
+  }
+
+  // the arena of the main thread, which took part in every loop, holds at
+  // most what one iteration needed
+  printf("arena of thread 0: %zu bytes\n", thread_arena::local().capacity());
+
+  delete[] dataset2;
+  delete[] check;
+  c_test::deallocate_statics();
+  return 0;
+}
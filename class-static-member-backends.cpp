@@ -0,0 +1,352 @@
+// testing one kernel definition with execution backends picked at runtime
+//
+// class-static-member.cpp, class-static-member-openMP.cpp and
+// class-static-member-openacc.cpp contain the same logic three times, and
+// which version runs is decided by which file gets compiled. Here every
+// kernel is written once, as a small struct with an operator() that handles
+// a single index, and one function
+//
+//   parallel_for(n, kernel)
+//
+// runs it over 0 ... n - 1 on the backend selected at runtime:
+//
+//   serial   a plain loop
+//   openmp   #pragma omp parallel for, on the host cores
+//   target   #pragma omp target teams distribute parallel for (this falls
+//            back to the host if there is no offload device)
+//   openacc  #pragma acc parallel loop (GCC runs this on the host)
+//
+// The backend is taken from the environment variable KERNEL_BACKEND, or set
+// with set_backend(). Data is moved with device_enter, device_exit and
+// device_update_self, which do nothing for the host backends, and kernels are
+// handed pointers obtained from device_ptr, which are the device addresses
+// for the device backends.
+//
+// Note that c_test here holds its table through a pointer member instead of
+// a static member. A static member would need its own 'declare target' or
+// 'declare create' copy for every device backend, whereas the instance can
+// simply be copied into the kernel, as in class-shared-array-openMP.cpp.
+//
+// The kernels are the loops of the snippets: the report_number loop of
+// class-static-member-openMP.cpp, fill of openacc-present-test.cpp and copyAB
+// of openacc-multi-D-array-pointer.c. main() runs them on the backend from
+// KERNEL_BACKEND, or on all backends in turn if it is unset, so the backends
+// can be compared on the same input without rebuilding.
+//
+// compiled with g++ class-static-member-backends.cpp -fopenmp -fopenacc -O2 -Wall
+// run with e.g. KERNEL_BACKEND=openmp ./a.out
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+#ifdef _OPENACC
+  #include <openacc.h>
+#endif
+
+enum exec_backend
+{
+  BACKEND_SERIAL,
+  BACKEND_OPENMP,
+  BACKEND_OMP_TARGET,
+  BACKEND_OPENACC,
+  NUM_BACKENDS
+};
+
+const char* backend_names[NUM_BACKENDS] = { "serial", "openmp", "target",
+  "openacc" };
+
+static exec_backend active_backend = BACKEND_OPENMP;
+
+void set_backend(exec_backend backend)
+{
+#ifndef _OPENACC
+  if (backend == BACKEND_OPENACC)
+  {
+    printf("not compiled with OpenACC, using the serial backend instead\n");
+    backend = BACKEND_SERIAL;
+  }
+#endif
+  active_backend = backend;
+}
+
+// returns 0 and sets the backend if KERNEL_BACKEND holds a valid name
+int set_backend_from_env()
+{
+  const char* name = getenv("KERNEL_BACKEND");
+
+  if (name == NULL) return -1;
+  for (int b = 0; b < NUM_BACKENDS; b++)
+  {
+    if (strcmp(name, backend_names[b]) == 0)
+    {
+      set_backend((exec_backend) b);
+      return 0;
+    }
+  }
+
+  printf("unknown KERNEL_BACKEND '%s'\n", name);
+  return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// data movement for the device backends
+
+template <class T>
+void device_enter(T* p, long n, bool copy)
+{
+  if (active_backend == BACKEND_OMP_TARGET)
+  {
+    if (copy)
+    {
+      #pragma omp target enter data map(to: p[0:n])
+    }
+    else
+    {
+      #pragma omp target enter data map(alloc: p[0:n])
+    }
+  }
+#ifdef _OPENACC
+  else if (active_backend == BACKEND_OPENACC)
+  {
+    if (copy) acc_copyin(p, n * sizeof(T)); else acc_create(p, n * sizeof(T));
+  }
+#endif
+}
+
+template <class T>
+void device_update_self(T* p, long n)
+{
+  if (active_backend == BACKEND_OMP_TARGET)
+  {
+    #pragma omp target update from(p[0:n])
+  }
+#ifdef _OPENACC
+  else if (active_backend == BACKEND_OPENACC)
+  {
+    acc_update_self(p, n * sizeof(T));
+  }
+#endif
+}
+
+template <class T>
+void device_exit(T* p, long n)
+{
+  if (active_backend == BACKEND_OMP_TARGET)
+  {
+    #pragma omp target exit data map(delete: p[0:n])
+  }
+#ifdef _OPENACC
+  else if (active_backend == BACKEND_OPENACC)
+  {
+    acc_delete(p, n * sizeof(T));
+  }
+#endif
+}
+
+// the address under which the kernels can reach p, which must have been
+// entered already
+template <class T>
+T* device_ptr(T* p)
+{
+  T* d = p;
+
+  if (active_backend == BACKEND_OMP_TARGET)
+  {
+    #pragma omp target data use_device_ptr(d)
+    {
+      p = d;
+    }
+  }
+#ifdef _OPENACC
+  else if (active_backend == BACKEND_OPENACC)
+  {
+    p = (T*) acc_deviceptr(p);
+  }
+#endif
+
+  return p;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// the dispatcher. The kernel is copied into every backend by value, so
+// kernels should only hold (device) pointers and scalars.
+
+template <class Kernel>
+void parallel_for(long n, const Kernel& kernel_in)
+{
+  Kernel kernel = kernel_in;
+  long i;
+
+  switch (active_backend)
+  {
+    case BACKEND_SERIAL:
+      for (i = 0; i < n; i++) kernel(i);
+      break;
+
+    case BACKEND_OPENMP:
+      #pragma omp parallel for schedule(static)
+      for (i = 0; i < n; i++) kernel(i);
+      break;
+
+    case BACKEND_OMP_TARGET:
+      #pragma omp target teams distribute parallel for firstprivate(kernel)
+      for (i = 0; i < n; i++) kernel(i);
+      break;
+
+    case BACKEND_OPENACC:
+      #pragma acc parallel loop firstprivate(kernel)
+      for (i = 0; i < n; i++) kernel(i);
+      break;
+
+    default:
+      break;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// the class and the kernels. Every operator() is compiled for the OpenMP
+// device through 'declare target'. For OpenACC, GCC does not accept an
+// 'acc routine' at class scope, but member functions defined in the class
+// body are compiled for the device implicitly when used in a compute region.
+
+class c_test
+{
+  public:
+
+    const long* dataset;
+
+    #pragma omp declare target
+    long report_number(long i) const { return dataset[i]; }
+    #pragma omp end declare target
+};
+
+// dataset2[i] = C.report_number(i), as in class-static-member-openMP.cpp
+struct report_kernel
+{
+  c_test C;
+  long* dataset2;
+
+  #pragma omp declare target
+  void operator()(long i) const { dataset2[i] = C.report_number(i); }
+  #pragma omp end declare target
+};
+
+// X[i] = value, as in fill of openacc-present-test.cpp
+struct fill_kernel
+{
+  double* X;
+  double value;
+
+  #pragma omp declare target
+  void operator()(long i) const { X[i] = value; }
+  #pragma omp end declare target
+};
+
+// B = A on a flat N_x * N_y grid, as copyAB with collapse(2)
+struct copyAB_kernel
+{
+  const double* A;
+  double* B;
+
+  #pragma omp declare target
+  void operator()(long ij) const { B[ij] = A[ij]; }
+  #pragma omp end declare target
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// run the three kernels on the active backend and check the results
+int run_all(long res, long N)
+{
+  long i;
+  double t0, t_report, t_fill, t_copy;
+
+  long* dataset = new long[res];
+  long* dataset2 = new long[res];
+  double* X = new double[N * N];
+  double* A = new double[N * N];
+  double* B = new double[N * N];
+
+  for (i = 0; i < res; i++) dataset[i] = i;
+  for (i = 0; i < N * N; i++) A[i] = (double) i;
+
+  device_enter(dataset, res, true);
+  device_enter(dataset2, res, false);
+  device_enter(X, N * N, false);
+  device_enter(A, N * N, true);
+  device_enter(B, N * N, false);
+
+  report_kernel rk;
+  rk.C.dataset = device_ptr(dataset);
+  rk.dataset2 = device_ptr(dataset2);
+  fill_kernel fk = { device_ptr(X), 42. };
+  copyAB_kernel ck = { device_ptr(A), device_ptr(B) };
+
+  // once to warm up (thread pools, device start up), then timed
+  parallel_for(res, rk);
+  t0 = omp_get_wtime();
+  parallel_for(res, rk);
+  t_report = omp_get_wtime() - t0;
+
+  parallel_for(N * N, fk);
+  t0 = omp_get_wtime();
+  parallel_for(N * N, fk);
+  t_fill = omp_get_wtime() - t0;
+
+  parallel_for(N * N, ck);
+  t0 = omp_get_wtime();
+  parallel_for(N * N, ck);
+  t_copy = omp_get_wtime() - t0;
+
+  device_update_self(dataset2, res);
+  device_update_self(X, N * N);
+  device_update_self(B, N * N);
+
+  int errors = 0;
+  for (i = 0; i < res; i++) errors += dataset2[i] != i;
+  for (i = 0; i < N * N; i++) errors += X[i] != 42. || B[i] != A[i];
+
+  printf("%-8s report_number: %9.6f s  fill: %9.6f s  copyAB: %9.6f s  %s\n",
+    backend_names[active_backend], t_report, t_fill, t_copy,
+    errors == 0 ? "ok" : "WRONG");
+
+  device_exit(dataset, res);
+  device_exit(dataset2, res);
+  device_exit(X, N * N);
+  device_exit(A, N * N);
+  device_exit(B, N * N);
+
+  delete[] dataset;
+  delete[] dataset2;
+  delete[] X;
+  delete[] A;
+  delete[] B;
+
+  return errors;
+}
+
+int main(int argc, char** argv)
+{
+  long res = 10000000;
+  long N = 2048;
+  int errors = 0;
+
+  if (argc > 1) res = atol(argv[1]);
+  if (argc > 2) N = atol(argv[2]);
+
+  if (set_backend_from_env() == 0)
+  {
+    errors = run_all(res, N);
+  }
+  else
+  {
+    for (int b = 0; b < NUM_BACKENDS; b++)
+    {
+      set_backend((exec_backend) b);
+      errors += run_all(res, N);
+    }
+  }
+
+  return errors != 0;
+}
@@ -0,0 +1,290 @@
+// testing a static member table that the compiler generates
+//
+// motivation: in class-static-member-openMP.cpp the size of the dataset is a
+// runtime 'static int res', and the table is filled by initialize_dataset at
+// startup. Neither can be helped when the size is only known at runtime. But
+// when the size and the contents are fixed (a lookup table of a known
+// function, say), the compiler can do all of it: here
+//
+//   c_test_fixed<Res, Generator>
+//
+// holds its table as a 'static constexpr std::array<long, Res>', filled with
+// Generator::value(i) by a constexpr function while compiling. The table is
+// part of the executable's read-only data (.rodata), so there is nothing to
+// allocate or initialize, it is shared between processes running the same
+// executable, and it can not be overwritten by accident. The size is a
+// constant, so loops over the table have a known trip count, and lookups at
+// constant indices are folded away entirely (see the static_asserts in
+// main). The runtime c_test stays as it was, for sizes known only at runtime.
+//
+// The price is paid at compile time: GCC evaluates the generator for every
+// entry, and by default refuses constexpr loops of more than 262144
+// iterations (-fconstexpr-loop-limit) and more than 2^25 operations in total
+// (-fconstexpr-ops-limit). Tables of a few hundred thousand entries are fine,
+// for much larger tables those limits, compile time and executable size make
+// the runtime version the better choice.
+//
+// main() compares the two on startup (allocation and filling, or nothing),
+// and on lookup throughput, sequential and at random indices, for the
+// identity table of class-static-member-openMP.cpp and a hash table.
+//
+// compiled with g++ -std=c++17 class-static-member-constexpr-openMP.cpp -fopenmp -O2 -Wall
+// check where the table went with objdump -t a.out | grep dataset
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <array>
+#include <omp.h>
+
+#define RES_SMALL 100 // as in class-static-member-openMP.cpp
+#define RES_LARGE 131072
+
+////////////////////////////////////////////////////////////////////////////////
+// generators: a struct with a constexpr value(i)
+
+// dataset[i] = i, as in initialize_dataset of class-static-member-openMP.cpp
+struct identity_generator
+{
+  static constexpr long value(long i) { return i; }
+};
+
+// a deterministic but irregular table, which the compiler can not reduce to
+// a formula when it is summed
+struct hash_generator
+{
+  static constexpr long value(long i)
+  {
+    unsigned long x = (unsigned long) i * 0x9E3779B97F4A7C15UL;
+    x ^= x >> 31;
+    x *= 0xBF58476D1CE4E5B9UL;
+    x ^= x >> 27;
+    return (long) (x & 0xffff);
+  }
+};
+
+template <long Res, class Generator>
+constexpr std::array<long, Res> generate_table()
+{
+  std::array<long, Res> table{};
+  for (long i = 0; i < Res; i++) table[i] = Generator::value(i);
+  return table;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// the compile-time class
+
+template <long Res, class Generator = identity_generator>
+class c_test_fixed
+{
+  public:
+
+    static constexpr long res = Res;
+
+    // static constexpr members are implicitly inline (C++17), so the table
+    // needs no definition outside the class
+    static constexpr std::array<long, Res> dataset =
+      generate_table<Res, Generator>();
+
+    constexpr long report_number(long i) const { return dataset[i]; }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// the runtime class of class-static-member-openMP.cpp
+
+class c_test
+{
+  public:
+
+    template <class Generator>
+    static void initialize_dataset(long res_arg);
+    static void deallocate_statics();
+
+    long report_number(long i) { return dataset[i]; }
+
+    static long* dataset;
+
+  protected:
+
+    static long res;
+};
+
+long* c_test::dataset = NULL;
+long c_test::res = 0;
+
+template <class Generator>
+void c_test::initialize_dataset(long res_arg)
+{
+  res = res_arg;
+  dataset = new long[res];
+
+  for (long i = 0; i < res; i++)
+  {
+    dataset[i] = Generator::value(i);
+  }
+}
+
+void c_test::deallocate_statics()
+{
+  if (dataset != NULL) { delete[] dataset; dataset = NULL; }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// the measurements. Every function makes its local instances as in
+// class-static-member-openMP.cpp.
+
+template <class Fixed>
+long sum_fixed(int repetitions)
+{
+  long sum = 0;
+
+  for (int r = 0; r < repetitions; r++)
+  {
+    #pragma omp parallel for reduction(+:sum) schedule(static)
+    for (long i = 0; i < Fixed::res; i++)
+    {
+      Fixed C;
+      sum += C.report_number(i);
+    }
+  }
+  return sum;
+}
+
+long sum_runtime(long res, int repetitions)
+{
+  long sum = 0;
+
+  for (int r = 0; r < repetitions; r++)
+  {
+    #pragma omp parallel for reduction(+:sum) schedule(static)
+    for (long i = 0; i < res; i++)
+    {
+      c_test C;
+      sum += C.report_number(i);
+    }
+  }
+  return sum;
+}
+
+template <class Fixed>
+long gather_fixed(const long* idx, long n)
+{
+  long sum = 0;
+
+  #pragma omp parallel for reduction(+:sum) schedule(static)
+  for (long k = 0; k < n; k++)
+  {
+    Fixed C;
+    sum += C.report_number(idx[k]);
+  }
+  return sum;
+}
+
+long gather_runtime(const long* idx, long n)
+{
+  long sum = 0;
+
+  #pragma omp parallel for reduction(+:sum) schedule(static)
+  for (long k = 0; k < n; k++)
+  {
+    c_test C;
+    sum += C.report_number(idx[k]);
+  }
+  return sum;
+}
+
+template <class Generator>
+int compare(const char* name, long num_lookups)
+{
+  typedef c_test_fixed<RES_LARGE, Generator> fixed;
+  const long res = RES_LARGE;
+  const int repetitions = (int) (num_lookups / res);
+  double t0, t_init, t_first_fixed, t_first_runtime;
+  long s_fixed, s_runtime;
+
+  // startup: the runtime table has to be allocated and filled, and its first
+  // use touches fresh pages. The compile-time table only has to be paged in
+  // from the executable on first use.
+  t0 = omp_get_wtime();
+  s_fixed = sum_fixed<fixed>(1);
+  t_first_fixed = omp_get_wtime() - t0;
+
+  t0 = omp_get_wtime();
+  c_test::initialize_dataset<Generator>(res);
+  t_init = omp_get_wtime() - t0;
+  t0 = omp_get_wtime();
+  s_runtime = sum_runtime(res, 1);
+  t_first_runtime = omp_get_wtime() - t0;
+
+  if (s_fixed != s_runtime)
+  {
+    printf("%s: the tables differ\n", name);
+    return 1;
+  }
+
+  printf("%s table, %ld entries\n", name, res);
+  printf("  startup:    compile-time %10.6f s (first pass), runtime %10.6f s "
+    "(initialize_dataset) + %10.6f s (first pass)\n", t_first_fixed, t_init,
+    t_first_runtime);
+
+  // sequential lookups
+  t0 = omp_get_wtime();
+  s_fixed = sum_fixed<fixed>(repetitions);
+  double t_fixed = omp_get_wtime() - t0;
+  t0 = omp_get_wtime();
+  s_runtime = sum_runtime(res, repetitions);
+  double t_runtime = omp_get_wtime() - t0;
+
+  printf("  sequential: compile-time %8.3f Glookups/s, runtime %8.3f "
+    "Glookups/s %s\n", 1e-9 * res * repetitions / t_fixed,
+    1e-9 * res * repetitions / t_runtime, s_fixed == s_runtime ? "" : "WRONG");
+
+  // lookups at random indices
+  long* idx = new long[num_lookups];
+  srand(42);
+  for (long k = 0; k < num_lookups; k++) idx[k] = rand() % res;
+
+  t0 = omp_get_wtime();
+  s_fixed = gather_fixed<fixed>(idx, num_lookups);
+  t_fixed = omp_get_wtime() - t0;
+  t0 = omp_get_wtime();
+  s_runtime = gather_runtime(idx, num_lookups);
+  t_runtime = omp_get_wtime() - t0;
+
+  printf("  random:     compile-time %8.3f Glookups/s, runtime %8.3f "
+    "Glookups/s %s\n", 1e-9 * num_lookups / t_fixed,
+    1e-9 * num_lookups / t_runtime, s_fixed == s_runtime ? "" : "WRONG");
+
+  delete[] idx;
+  c_test::deallocate_statics();
+  return s_fixed != s_runtime;
+}
+
+int main(int argc, char** argv)
+{
+  long num_lookups = argc > 1 ? atol(argv[1]) : 100000000;
+  int errors = 0;
+
+  // lookups at constant indices are done by the compiler
+  constexpr c_test_fixed<RES_SMALL> C;
+  static_assert(C.report_number(42) == 42, "identity table");
+  static_assert(c_test_fixed<RES_SMALL, hash_generator>::dataset[7]
+    == hash_generator::value(7), "hash table");
+
+  // the loop of class-static-member-openMP.cpp, without initialize_dataset
+  long* dataset2 = new long[RES_SMALL];
+  #pragma omp parallel for
+  for (long i = 0; i < RES_SMALL; i++)
+  {
+    c_test_fixed<RES_SMALL> C; // create a local instance of the class
+    dataset2[i] = C.report_number(i);
+  }
+  for (long i = 0; i < RES_SMALL; i += 33)
+    printf("entry %li has value %li\n", i, dataset2[i]);
+  delete[] dataset2;
+
+  printf("threads: %d\n", omp_get_max_threads());
+  errors += compare<identity_generator>("identity", num_lookups);
+  errors += compare<hash_generator>("hash", num_lookups);
+
+  return errors != 0;
+}
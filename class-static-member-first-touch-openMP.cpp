@@ -0,0 +1,179 @@
+// testing classes & static members: first-touch initialization
+//
+// motivation: class-static-member-openMP.cpp fills the static dataset in a
+// serial loop and then reads it from all threads. On a machine with several
+// NUMA nodes (ie a multi-socket node), the operating system places a page of
+// memory on the node of the thread that first writes to it ('first touch'),
+// so a serial initialization puts the whole dataset on the node of the master
+// thread. Threads on the other socket(s) then pay remote-memory latency on
+// every read.
+//
+// The fix is to initialize the dataset in parallel, using the same static
+// schedule as the loops that will consume it. Each thread then touches the
+// pages it will later read itself. Note that this only works because
+// 'new long[res]' does not write to the memory it returns (long has no
+// constructor), so no page is touched before the initialization loop.
+//
+// The main program benchmarks both initialization modes for 10^6 elements
+// and up. The largest size is given (as a power of ten) on the command line
+// and defaults to 10^8. Note that 10^9 elements take 8 GB of memory.
+//
+// compiled with g++ class-static-member-first-touch-openMP.cpp -fopenmp -O2 -Wall
+// run with e.g. OMP_PROC_BIND=spread OMP_PLACES=cores ./a.out 9 (threads must
+// be pinned, otherwise they may migrate away from the pages they touched)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <omp.h>
+
+#define NUM_REPEATS 5
+
+// the two ways of initializing the static dataset
+enum init_mode
+{
+  INIT_SERIAL,      // a single thread touches all pages (the original version)
+  INIT_FIRST_TOUCH  // pages are touched by the threads that will read them
+};
+
+// define a class for testing, including a static member array
+class c_test
+{
+  public:
+
+    static void initialize_dataset(long res_arg, init_mode mode);
+    static void deallocate_statics();
+
+    long report_number(long i);
+
+    static long* dataset;
+
+  protected:
+
+    static long res;
+};
+
+long* c_test::dataset = NULL;
+long c_test::res = 0;
+
+long c_test::report_number(long i)
+{
+  return dataset[i];
+}
+
+void c_test::initialize_dataset(long res_arg, init_mode mode)
+{
+  long i;
+
+  res = res_arg;
+  dataset = new long[res]; // no pages have been touched yet at this point
+
+  if (mode == INIT_FIRST_TOUCH)
+  {
+    // the schedule needs to match the one used by the consumer loops. A
+    // plain schedule(static) always hands out the same contiguous block of
+    // iterations to the same thread for the same loop length and number of
+    // threads, so this is a safe choice.
+    #pragma omp parallel for private(i) schedule(static)
+    for (i = 0; i < res; i++)
+    {
+      dataset[i] = i;
+    }
+  }
+  else
+  {
+    for (i = 0; i < res; i++)
+    {
+      dataset[i] = i;
+    }
+  }
+}
+
+void c_test::deallocate_statics()
+{
+  if (dataset != NULL) { delete[] dataset; dataset = NULL; }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the consumer loop, equivalent to the one in class-static-member-openMP.cpp
+// but summing the entries instead of copying them into a second array, so
+// that only the reads from the static dataset get measured.
+long consume(long res)
+{
+  long i;
+  long sum = 0;
+
+  #pragma omp parallel for private(i) schedule(static) reduction(+:sum)
+  for (i = 0; i < res; i++)
+  {
+    c_test C; // create a local instance of the class
+    sum += C.report_number(i);
+  }
+
+  return sum;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// time the initialization and a subsequent read sweep for one mode, keeping
+// the best of NUM_REPEATS. The dataset is freed and allocated again for every
+// repeat, so that every repeat starts from untouched pages (large blocks are
+// returned to the operating system by delete[]).
+void benchmark(long res, init_mode mode, double* t_init, double* t_read)
+{
+  int r;
+  double t0, t1, t2;
+  long sum;
+
+  *t_init = 1e30;
+  *t_read = 1e30;
+
+  for (r = 0; r < NUM_REPEATS; r++)
+  {
+    t0 = omp_get_wtime();
+    c_test::initialize_dataset(res, mode);
+    t1 = omp_get_wtime();
+    sum = consume(res);
+    t2 = omp_get_wtime();
+    c_test::deallocate_statics();
+
+    // check the answer, which also keeps the compiler from dropping the sum
+    if (sum != res * (res - 1) / 2)
+    {
+      printf("wrong sum %li for res = %li\n", sum, res);
+      exit(1);
+    }
+
+    if (t1 - t0 < *t_init) *t_init = t1 - t0;
+    if (t2 - t1 < *t_read) *t_read = t2 - t1;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  int max_exponent = 8;
+  int exponent;
+  long res;
+  double t_init_serial, t_read_serial, t_init_ft, t_read_ft;
+
+  if (argc > 1) max_exponent = atoi(argv[1]);
+
+  printf("threads: %i, proc_bind: %i\n", omp_get_max_threads(),
+    (int) omp_get_proc_bind());
+  printf("%12s %14s %14s %14s %14s %10s\n", "res", "init serial",
+    "read serial", "init f-touch", "read f-touch", "read gain");
+
+  for (exponent = 6, res = 1000000; exponent <= max_exponent;
+    exponent++, res *= 10)
+  {
+    benchmark(res, INIT_SERIAL, &t_init_serial, &t_read_serial);
+    benchmark(res, INIT_FIRST_TOUCH, &t_init_ft, &t_read_ft);
+
+    printf("%12li %12.6f s %12.6f s %12.6f s %12.6f s %9.2fx\n", res,
+      t_init_serial, t_read_serial, t_init_ft, t_read_ft,
+      t_read_serial / t_read_ft);
+    fflush(stdout);
+  }
+
+  return 0;
+}
@@ -0,0 +1,280 @@
+// testing classes & static members: batched lookups with SIMD gathers
+//
+// motivation: c_test::report_number(i) does a single lookup per call. Loops
+// that look up millions of entries from a vector of indices pay a call (if
+// not inlined) and a scalar load per entry. This snippet adds a batched
+// version
+//
+//   void report_numbers(const long* idx, long* out, size_t n);
+//
+// that looks up n entries at once, using the gather instructions of AVX2
+// (4 entries per instruction) or AVX-512 (8 entries per instruction) where
+// the CPU has them, and a plain scalar loop otherwise.
+//
+// The kernels are compiled with GCC's target attribute, so that the program
+// as a whole does not need to be compiled with -mavx2 or -mavx512f and still
+// runs on any x86-64 machine. Which kernel gets used is decided once at
+// runtime, by asking the CPU what it supports (__builtin_cpu_supports). The
+// choice can be overridden with the environment variable C_TEST_GATHER set to
+// 'scalar', 'avx2' or 'avx512', for testing. On other architectures only the
+// scalar kernel is built.
+//
+// Inside a parallel loop, every thread handles one contiguous batch of the
+// index vector (see main).
+//
+// compiled with g++ class-static-member-gather-openMP.cpp -fopenmp -O2 -Wall
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+#if defined(__x86_64__)
+  #include <immintrin.h>
+  #define HAVE_X86_GATHER
+#endif
+
+#define NUM_REPEATS 5
+
+typedef void (*gather_kernel)(const long* table, const long* idx, long* out,
+  size_t n);
+
+// define a class for testing, including a static member array
+class c_test
+{
+  public:
+
+    static void initialize_dataset(int res_arg);
+    static void deallocate_statics();
+
+    long report_number(long i);
+    void report_numbers(const long* idx, long* out, size_t n);
+
+    static const char* gather_kernel_name();
+
+    static long* dataset;
+
+  protected:
+
+    static int res;
+    static gather_kernel kernel; // selected once, by select_gather_kernel
+    static const char* kernel_name;
+
+    static void select_gather_kernel();
+};
+
+static void gather_scalar(const long* table, const long* idx, long* out,
+  size_t n);
+
+long* c_test::dataset = NULL;
+int c_test::res = 0;
+// the scalar kernel until select_gather_kernel has run, so that the pointer
+// is never NULL
+gather_kernel c_test::kernel = gather_scalar;
+const char* c_test::kernel_name = "scalar";
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void gather_scalar(const long* table, const long* idx, long* out,
+  size_t n)
+{
+  for (size_t k = 0; k < n; k++) out[k] = table[idx[k]];
+}
+
+#ifdef HAVE_X86_GATHER
+
+__attribute__((target("avx2")))
+static void gather_avx2(const long* table, const long* idx, long* out,
+  size_t n)
+{
+  size_t k = 0;
+
+  for (; k + 4 <= n; k += 4)
+  {
+    __m256i vi = _mm256_loadu_si256((const __m256i*) (idx + k));
+    __m256i v = _mm256_i64gather_epi64((const long long*) table, vi, 8);
+    _mm256_storeu_si256((__m256i*) (out + k), v);
+  }
+  for (; k < n; k++) out[k] = table[idx[k]];
+}
+
+__attribute__((target("avx512f")))
+static void gather_avx512(const long* table, const long* idx, long* out,
+  size_t n)
+{
+  size_t k = 0;
+
+  for (; k + 8 <= n; k += 8)
+  {
+    __m512i vi = _mm512_loadu_si512((const void*) (idx + k));
+    // the masked form with a full mask is the same instruction, but avoids
+    // a spurious uninitialized-variable warning from GCC's header
+    __m512i v = _mm512_mask_i64gather_epi64(_mm512_setzero_si512(), 0xff, vi,
+      (const long long*) table, 8);
+    _mm512_storeu_si512((void*) (out + k), v);
+  }
+
+  // the remainder is done with a masked gather rather than a scalar loop
+  if (k < n)
+  {
+    __mmask8 m = (__mmask8) ((1u << (n - k)) - 1);
+    __m512i vi = _mm512_maskz_loadu_epi64(m, (const void*) (idx + k));
+    __m512i v = _mm512_mask_i64gather_epi64(_mm512_setzero_si512(), m, vi,
+      (const long long*) table, 8);
+    _mm512_mask_storeu_epi64((void*) (out + k), m, v);
+  }
+}
+
+#endif
+
+void c_test::select_gather_kernel()
+{
+  const char* force = getenv("C_TEST_GATHER");
+
+  kernel = gather_scalar;
+  kernel_name = "scalar";
+
+#ifdef HAVE_X86_GATHER
+  __builtin_cpu_init();
+
+  if (force != NULL && strcmp(force, "scalar") == 0) return;
+
+  if (__builtin_cpu_supports("avx512f")
+    && (force == NULL || strcmp(force, "avx512") == 0))
+  {
+    kernel = gather_avx512;
+    kernel_name = "avx512";
+  }
+  else if (__builtin_cpu_supports("avx2")
+    && (force == NULL || strcmp(force, "avx2") == 0))
+  {
+    kernel = gather_avx2;
+    kernel_name = "avx2";
+  }
+#else
+  (void) force;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+long c_test::report_number(long i)
+{
+  return dataset[i];
+}
+
+void c_test::report_numbers(const long* idx, long* out, size_t n)
+{
+  kernel(dataset, idx, out, n);
+}
+
+const char* c_test::gather_kernel_name()
+{
+  return kernel_name;
+}
+
+void c_test::initialize_dataset(int res_arg)
+{
+  long i;
+
+  res = res_arg;
+  dataset = new long[res];
+
+  // picking the kernel here, once, means report_numbers never has to check
+  // whether it has been picked yet
+  select_gather_kernel();
+
+  printf("initializing data set...\n");
+  #pragma omp parallel for private(i) schedule(static)
+  for (i = 0; i < res; i++)
+  {
+    dataset[i] = 3 * i;
+  }
+}
+
+void c_test::deallocate_statics()
+{
+  if (dataset != NULL) { delete[] dataset; dataset = NULL; }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char** argv)
+{
+  int res = 1000000; // size of the table
+  long n = 50000000; // number of lookups
+  long i;
+  int r;
+  double t0, t, t_scalar = 1e30, t_batched = 1e30;
+
+  if (argc > 1) res = atoi(argv[1]);
+  if (argc > 2) n = atol(argv[2]);
+
+  c_test::initialize_dataset(res);
+  printf("gather kernel: %s\n", c_test::gather_kernel_name());
+
+  long* idx = new long[n];
+  long* out = new long[n];
+  long* ref = new long[n];
+
+  // random indices, generated in parallel with a simple per-thread LCG
+  #pragma omp parallel
+  {
+    unsigned long state = 12345 + 7919 * omp_get_thread_num();
+    #pragma omp for private(i) schedule(static)
+    for (i = 0; i < n; i++)
+    {
+      state = state * 6364136223846793005ul + 1442695040888963407ul;
+      idx[i] = (long) ((state >> 33) % res);
+    }
+  }
+
+  for (r = 0; r < NUM_REPEATS; r++)
+  {
+    // the scalar version, one report_number call per iteration
+    t0 = omp_get_wtime();
+    #pragma omp parallel for private(i) schedule(static)
+    for (i = 0; i < n; i++)
+    {
+      c_test C; // create a local instance of the class
+      ref[i] = C.report_number(idx[i]);
+    }
+    t = omp_get_wtime() - t0;
+    if (t < t_scalar) t_scalar = t;
+
+    // the batched version, one contiguous batch per thread
+    t0 = omp_get_wtime();
+    #pragma omp parallel
+    {
+      int my_ID = omp_get_thread_num();
+      int ID_max = omp_get_num_threads();
+      long lo = n * my_ID / ID_max;
+      long hi = n * (my_ID + 1) / ID_max;
+
+      c_test C; // create a local instance of the class
+      C.report_numbers(idx + lo, out + lo, hi - lo);
+    }
+    t = omp_get_wtime() - t0;
+    if (t < t_batched) t_batched = t;
+  }
+
+  for (i = 0; i < n; i++)
+  {
+    if (out[i] != ref[i] || out[i] != 3 * idx[i])
+    {
+      printf("mismatch at %li: %li versus %li\n", i, out[i], ref[i]);
+      return 1;
+    }
+  }
+
+  printf("threads: %i, table: %i entries, lookups: %li\n",
+    omp_get_max_threads(), res, n);
+  printf("scalar : %f s, %.1f M lookups/s\n", t_scalar, n / t_scalar * 1e-6);
+  printf("batched: %f s, %.1f M lookups/s\n", t_batched,
+    n / t_batched * 1e-6);
+
+  delete[] idx;
+  delete[] out;
+  delete[] ref;
+  c_test::deallocate_statics();
+  return 0;
+}
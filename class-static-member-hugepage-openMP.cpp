@@ -0,0 +1,318 @@
+// testing classes & static members: aligned and huge-page backed allocation
+//
+// motivation: in class-static-member-openMP.cpp both the static dataset and
+// the output array dataset2 come from a plain 'new long[res]'. That gives no
+// guarantee of cache-line alignment and the memory is backed by regular 4 KiB
+// pages, so that at large sizes a sweep over the arrays spends a noticeable
+// amount of time on TLB misses. Huge pages (2 MiB on x86-64) cover 512 times
+// as much memory per TLB entry.
+//
+// This snippet adds an allocation policy for the arrays:
+//
+//   ALLOC_ALIGNED          64-byte (cache line) aligned, regular pages
+//   ALLOC_HUGE_TRANSPARENT 2 MiB aligned, with madvise(MADV_HUGEPAGE) asking
+//                          the kernel for transparent huge pages
+//   ALLOC_HUGE_EXPLICIT    mmap with MAP_HUGETLB, which needs huge pages to
+//                          have been reserved by the administrator (see
+//                          /proc/sys/vm/nr_hugepages). If that fails we fall
+//                          back to transparent huge pages, and from there to
+//                          aligned regular pages.
+//
+// Because of the fallbacks, the backing that was actually obtained is stored
+// alongside the pointer, and deallocation uses that to pick free() or munmap.
+// For transparent huge pages the kernel is still free to ignore the advice,
+// so after initialization we also look up how much of the array is really
+// covered by huge pages in /proc/self/smaps.
+//
+// compiled with g++ class-static-member-hugepage-openMP.cpp -fopenmp -O2 -Wall
+// run with ./a.out [aligned|thp|hugetlb] [res]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <omp.h>
+
+#define CACHE_LINE_SIZE 64
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// what the caller asks for
+enum alloc_policy
+{
+  ALLOC_ALIGNED,
+  ALLOC_HUGE_TRANSPARENT,
+  ALLOC_HUGE_EXPLICIT
+};
+
+// what the caller actually got
+enum alloc_backing
+{
+  BACKING_NONE,
+  BACKING_ALIGNED,     // posix_memalign, released with free()
+  BACKING_TRANSPARENT, // posix_memalign + madvise, released with free()
+  BACKING_HUGETLB      // mmap, released with munmap()
+};
+
+const char* backing_name(alloc_backing backing)
+{
+  switch (backing)
+  {
+    case BACKING_ALIGNED:     return "aligned 4 KiB pages";
+    case BACKING_TRANSPARENT: return "transparent huge pages (advised)";
+    case BACKING_HUGETLB:     return "explicit huge pages (MAP_HUGETLB)";
+    default:                  return "none";
+  }
+}
+
+// a block of memory together with the information needed to release it
+typedef struct aligned_block
+{
+  long* data;
+  size_t bytes; // the mapped length, which may be larger than requested
+  alloc_backing backing;
+} aligned_block;
+
+////////////////////////////////////////////////////////////////////////////////
+
+static size_t round_up(size_t n, size_t multiple)
+{
+  return ((n + multiple - 1) / multiple) * multiple;
+}
+
+aligned_block allocate_block(long n, alloc_policy policy)
+{
+  aligned_block b;
+  void* p;
+  size_t bytes = n * sizeof(long);
+
+  b.data = NULL;
+  b.bytes = 0;
+  b.backing = BACKING_NONE;
+
+  if (policy == ALLOC_HUGE_EXPLICIT)
+  {
+    bytes = round_up(bytes, HUGE_PAGE_SIZE);
+    p = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED)
+    {
+      b.data = (long*) p;
+      b.bytes = bytes;
+      b.backing = BACKING_HUGETLB;
+      return b;
+    }
+    // no (or not enough) reserved huge pages, try transparent ones instead
+    policy = ALLOC_HUGE_TRANSPARENT;
+  }
+
+  if (policy == ALLOC_HUGE_TRANSPARENT)
+  {
+    // align to a huge page boundary, otherwise the kernel can only use huge
+    // pages for the part of the block that happens to be 2 MiB aligned
+    bytes = round_up(bytes, HUGE_PAGE_SIZE);
+    if (posix_memalign(&p, HUGE_PAGE_SIZE, bytes) == 0)
+    {
+      b.data = (long*) p;
+      b.bytes = bytes;
+      // madvise fails if the kernel has no THP support, in which case the
+      // block is still perfectly usable with regular pages
+      if (madvise(p, bytes, MADV_HUGEPAGE) == 0)
+        b.backing = BACKING_TRANSPARENT;
+      else
+        b.backing = BACKING_ALIGNED;
+      return b;
+    }
+    bytes = n * sizeof(long);
+  }
+
+  if (posix_memalign(&p, CACHE_LINE_SIZE, bytes) == 0)
+  {
+    b.data = (long*) p;
+    b.bytes = bytes;
+    b.backing = BACKING_ALIGNED;
+  }
+
+  return b;
+}
+
+void free_block(aligned_block* b)
+{
+  if (b->data == NULL) return;
+
+  if (b->backing == BACKING_HUGETLB)
+    munmap(b->data, b->bytes);
+  else
+    free(b->data);
+
+  b->data = NULL;
+  b->bytes = 0;
+  b->backing = BACKING_NONE;
+}
+
+// look up the mapping that contains the block in /proc/self/smaps and return
+// how many kB of it are backed by huge pages (AnonHugePages for transparent
+// huge pages, the whole mapping for hugetlbfs), or -1 if it could not be found.
+// Only pages that have been touched show up, so call this after initializing.
+long huge_page_kb(const aligned_block* b)
+{
+  FILE* f;
+  char line[512];
+  unsigned long start, end;
+  unsigned long addr = (unsigned long) b->data;
+  int in_mapping = 0;
+  long kb = -1;
+
+  f = fopen("/proc/self/smaps", "r");
+  if (f == NULL) return -1;
+
+  while (fgets(line, sizeof(line), f) != NULL)
+  {
+    // mapping header lines start with the address range, attribute lines
+    // start with a name (which never parses as 'hex-hex')
+    if (sscanf(line, "%lx-%lx ", &start, &end) == 2)
+    {
+      if (in_mapping) break; // reached the next mapping
+      in_mapping = (addr >= start && addr < end);
+      continue;
+    }
+
+    if (!in_mapping) continue;
+
+    if (b->backing == BACKING_HUGETLB)
+    {
+      if (sscanf(line, "Private_Hugetlb: %ld kB", &kb) == 1) break;
+    }
+    else
+    {
+      if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1) break;
+    }
+  }
+
+  fclose(f);
+  return kb;
+}
+
+void report_block(const char* name, const aligned_block* b)
+{
+  long kb = huge_page_kb(b);
+
+  printf("%s: %p, %zu bytes, 64-byte aligned: %s, backing: %s", name,
+    (void*) b->data, b->bytes,
+    ((unsigned long) b->data % CACHE_LINE_SIZE == 0) ? "yes" : "no",
+    backing_name(b->backing));
+  if (kb >= 0)
+    printf(", %ld kB in huge pages\n", kb);
+  else
+    printf("\n");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// define a class for testing, including a static member array
+class c_test
+{
+  public:
+
+    static void initialize_dataset(int res_arg, alloc_policy policy);
+    static void deallocate_statics();
+
+    long report_number(long i);
+
+    static long* dataset;
+    static aligned_block dataset_block; // remembers how dataset was allocated
+
+  protected:
+
+    static int res;
+};
+
+long* c_test::dataset = NULL;
+aligned_block c_test::dataset_block = { NULL, 0, BACKING_NONE };
+int c_test::res = 0;
+
+long c_test::report_number(long i)
+{
+  return dataset[i];
+}
+
+void c_test::initialize_dataset(int res_arg, alloc_policy policy)
+{
+  long i;
+
+  res = res_arg;
+  dataset_block = allocate_block(res, policy);
+  dataset = dataset_block.data;
+  if (dataset == NULL)
+  {
+    printf("could not allocate the dataset\n");
+    exit(1);
+  }
+
+  printf("initializing data set...\n");
+  #pragma omp parallel for private(i) schedule(static)
+  for (i = 0; i < res; i++)
+  {
+    dataset[i] = i;
+  }
+}
+
+void c_test::deallocate_statics()
+{
+  // the release has to match the backing that was actually obtained, rather
+  // than the policy that was asked for
+  free_block(&dataset_block);
+  dataset = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char** argv)
+{
+  alloc_policy policy = ALLOC_HUGE_TRANSPARENT;
+  int res = 100000000;
+  int i;
+  double t0, t1;
+
+  if (argc > 1)
+  {
+    if (strcmp(argv[1], "aligned") == 0) policy = ALLOC_ALIGNED;
+    else if (strcmp(argv[1], "thp") == 0) policy = ALLOC_HUGE_TRANSPARENT;
+    else if (strcmp(argv[1], "hugetlb") == 0) policy = ALLOC_HUGE_EXPLICIT;
+    else
+    {
+      printf("usage: %s [aligned|thp|hugetlb] [res]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (argc > 2) res = atoi(argv[2]);
+
+  c_test::initialize_dataset(res, policy);
+
+  aligned_block dataset2_block = allocate_block(res, policy);
+  long* dataset2 = dataset2_block.data;
+  if (dataset2 == NULL)
+  {
+    printf("could not allocate dataset2\n");
+    return 1;
+  }
+
+  t0 = omp_get_wtime();
+  #pragma omp parallel for private(i) schedule(static)
+  for (i = 0; i < res; i++)
+  {
+    c_test C; // create a local instance of the class
+    dataset2[i] = C.report_number(i);
+  }
+  t1 = omp_get_wtime();
+
+  report_block("dataset ", &c_test::dataset_block);
+  report_block("dataset2", &dataset2_block);
+
+  printf("copy loop: %f s, %.2f GB/s\n", t1 - t0,
+    2. * res * sizeof(long) / (t1 - t0) * 1e-9);
+  printf("entry %i has value %li\n", res - 1, dataset2[res - 1]);
+
+  free_block(&dataset2_block);
+  c_test::deallocate_statics();
+  return 0;
+}
@@ -0,0 +1,247 @@
+// testing a static member dataset that is filled in blocks, on first use
+//
+// motivation: initialize_dataset in class-static-member-openMP.cpp fills all
+// res entries before anything can be looked up. With a large table whose
+// entries are expensive to compute, and a run that only looks at a small part
+// of it, most of that startup time is wasted.
+//
+// Here initialize_dataset(res, INIT_LAZY) only allocates the table. The table
+// is divided into blocks of BLOCK_SIZE entries, and every block has an atomic
+// state:
+//
+//   BLOCK_EMPTY    nothing computed yet
+//   BLOCK_FILLING  one thread is computing the block
+//   BLOCK_READY    the block can be read
+//
+// report_number(i) checks the state of the block of i. Once the block is
+// ready, that is the only cost: one load (a plain mov on x86, as acquire
+// ordering comes for free there) and one branch that is practically always
+// taken the same way. Otherwise it calls fill_block, outside the fast path,
+// where the first thread to arrive moves the state from EMPTY to FILLING
+// with a compare and swap, computes the block and publishes it as READY.
+// Threads that arrive while a block is being filled wait for that block only;
+// there is no lock over the whole table, so different blocks fill in parallel.
+//
+// INIT_EAGER fills the table up front, in parallel, and marks all blocks
+// ready, so that both modes share the same report_number.
+//
+// main() compares the modes on startup time, on a sparse run that looks up a
+// small fraction of the entries at random, and on a full pass once
+// everything is filled (which shows the cost of the state check).
+//
+// compiled with g++ class-static-member-lazy-openMP.cpp -fopenmp -O2 -Wall
+// run with ./a.out [res] [fraction looked up in the sparse run]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <omp.h>
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+#else
+  #include <thread>
+#endif
+
+#define BLOCK_SHIFT 12
+#define BLOCK_SIZE (1L << BLOCK_SHIFT) // entries per block
+
+// what a thread does while it waits for another one to fill a block: a pause
+// instruction on x86, which frees the core for its hyperthread sibling, and
+// giving up the time slice elsewhere
+static inline void wait_a_little()
+{
+#if defined(__SSE2__)
+  _mm_pause();
+#else
+  std::this_thread::yield();
+#endif
+}
+
+enum init_mode {INIT_EAGER, INIT_LAZY};
+
+enum block_state {BLOCK_EMPTY, BLOCK_FILLING, BLOCK_READY};
+
+// the value of entry i. Stands in for something more expensive than the
+// dataset[i] = i of class-static-member-openMP.cpp.
+static long compute_entry(long i)
+{
+  unsigned long x = (unsigned long) i;
+  for (int k = 0; k < 16; k++)
+  {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdUL;
+    __asm__ volatile("" : "+r" (x)); // keeps the compiler from dropping this
+  }
+  return i;
+}
+
+class c_test
+{
+  public:
+
+    static void initialize_dataset(long res_arg, init_mode mode);
+    static void deallocate_statics();
+
+    long report_number(long i)
+    {
+      long b = i >> BLOCK_SHIFT;
+      if (__builtin_expect(block_states[b].load(std::memory_order_acquire)
+        != BLOCK_READY, 0))
+        fill_block(b);
+      return dataset[i];
+    }
+
+    static long blocks_filled() { return num_filled.load(); }
+    static long num_blocks;
+
+  protected:
+
+    static long* dataset;
+    static long res;
+    static std::atomic<unsigned char>* block_states;
+    static std::atomic<long> num_filled;
+
+    static void fill_block(long b);
+    static void compute_block(long b);
+};
+
+long* c_test::dataset = NULL;
+long c_test::res = 0;
+long c_test::num_blocks = 0;
+std::atomic<unsigned char>* c_test::block_states = NULL;
+std::atomic<long> c_test::num_filled(0);
+
+void c_test::compute_block(long b)
+{
+  long start = b * BLOCK_SIZE;
+  long end = start + BLOCK_SIZE < res ? start + BLOCK_SIZE : res;
+
+  for (long i = start; i < end; i++) dataset[i] = compute_entry(i);
+}
+
+// the slow path of report_number. Kept out of line, so that the fast path
+// stays small enough to inline.
+__attribute__((noinline)) void c_test::fill_block(long b)
+{
+  unsigned char expected = BLOCK_EMPTY;
+
+  if (block_states[b].compare_exchange_strong(expected, BLOCK_FILLING,
+    std::memory_order_acquire))
+  {
+    compute_block(b);
+    num_filled++;
+    // release: whoever sees READY also sees the entries
+    block_states[b].store(BLOCK_READY, std::memory_order_release);
+    return;
+  }
+
+  // another thread is filling this block
+  while (block_states[b].load(std::memory_order_acquire) != BLOCK_READY)
+    wait_a_little();
+}
+
+void c_test::initialize_dataset(long res_arg, init_mode mode)
+{
+  res = res_arg;
+  num_blocks = (res + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  num_filled = 0;
+
+  // neither new[] of longs nor of atomics touches the memory, so for the lazy
+  // mode this costs next to nothing however large res is
+  dataset = new long[res];
+  block_states = new std::atomic<unsigned char>[num_blocks];
+
+  #pragma omp parallel for schedule(static)
+  for (long b = 0; b < num_blocks; b++)
+  {
+    if (mode == INIT_EAGER)
+    {
+      compute_block(b);
+      num_filled++;
+      block_states[b].store(BLOCK_READY, std::memory_order_relaxed);
+    }
+    else
+    {
+      block_states[b].store(BLOCK_EMPTY, std::memory_order_relaxed);
+    }
+  }
+}
+
+void c_test::deallocate_statics()
+{
+  if (dataset != NULL) { delete[] dataset; dataset = NULL; }
+  if (block_states != NULL) { delete[] block_states; block_states = NULL; }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int run(init_mode mode, long res, const long* idx, long num_lookups)
+{
+  const char* name = mode == INIT_EAGER ? "eager" : "lazy";
+  long errors = 0, sum = 0;
+  double t0, t_init, t_sparse, t_full;
+
+  t0 = omp_get_wtime();
+  c_test::initialize_dataset(res, mode);
+  t_init = omp_get_wtime() - t0;
+
+  // the sparse run: a few lookups at random, all threads at once, so that
+  // some of them meet in the same block
+  t0 = omp_get_wtime();
+  #pragma omp parallel for reduction(+:errors) schedule(static)
+  for (long k = 0; k < num_lookups; k++)
+  {
+    c_test C; // create a local instance of the class
+    errors += C.report_number(idx[k]) != idx[k];
+  }
+  t_sparse = omp_get_wtime() - t0;
+  long filled_sparse = c_test::blocks_filled();
+
+  // a full pass, which fills whatever is left, and a second one with all
+  // blocks ready
+  #pragma omp parallel for reduction(+:errors) schedule(static)
+  for (long i = 0; i < res; i++)
+  {
+    c_test C;
+    errors += C.report_number(i) != i;
+  }
+  t0 = omp_get_wtime();
+  #pragma omp parallel for reduction(+:sum) schedule(static)
+  for (long i = 0; i < res; i++)
+  {
+    c_test C;
+    sum += C.report_number(i);
+  }
+  t_full = omp_get_wtime() - t0;
+  errors += sum != res * (res - 1) / 2;
+
+  printf("%-6s init %9.6f s, sparse run %9.6f s (%ld of %ld blocks filled), "
+    "startup + sparse %9.6f s, full pass when ready %9.6f s %s\n", name,
+    t_init, t_sparse, filled_sparse, c_test::num_blocks, t_init + t_sparse,
+    t_full, errors == 0 ? "" : "WRONG");
+
+  c_test::deallocate_statics();
+  return errors != 0;
+}
+
+int main(int argc, char** argv)
+{
+  long res = argc > 1 ? atol(argv[1]) : 100000000;
+  double fraction = argc > 2 ? atof(argv[2]) : 0.0001;
+  long num_lookups = (long) (fraction * res) + 1;
+  int errors = 0;
+
+  long* idx = new long[num_lookups];
+  srand(42);
+  for (long k = 0; k < num_lookups; k++)
+    idx[k] = ((long) rand() * RAND_MAX + rand()) % res;
+
+  printf("res = %ld, %ld random lookups, blocks of %ld entries, %d threads\n",
+    res, num_lookups, BLOCK_SIZE, omp_get_max_threads());
+
+  errors += run(INIT_EAGER, res, idx, num_lookups);
+  errors += run(INIT_LAZY, res, idx, num_lookups);
+
+  delete[] idx;
+  return errors;
+}
@@ -0,0 +1,281 @@
+// testing classes & static members: a file-backed, memory-mapped dataset
+//
+// motivation: every process that uses c_test rebuilds the static dataset in
+// initialize_dataset. With many worker processes per node this costs startup
+// time, and every process holds its own private copy of the same table.
+// If instead the table is written to a file once, each process can map that
+// file read-only with mmap. All processes on the node then share the same
+// pages of the kernel's page cache, nothing is copied, and startup is reduced
+// to validating a header.
+//
+// File layout (native byte order, the file is meant to be used on the machine
+// type that wrote it):
+//
+//   bytes 0 .. 4095    header: magic string, format version, element type
+//                      code and size, res and the offset of the data
+//   bytes 4096 ..      res entries of the element type
+//
+// The data starts at a page boundary so that the mapped table is page (and
+// therefore cache line) aligned.
+//
+// The same program is both the writer tool and a demonstration of the loader:
+//
+//   ./a.out write dataset.bin 100000000   generate the table with the usual
+//                                         initialization logic and store it
+//   ./a.out read dataset.bin              map the table and run the usual
+//                                         parallel read loop over it
+//
+// compiled with g++ class-static-member-mmap-openMP.cpp -fopenmp -O2 -Wall
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <omp.h>
+
+#define DATASET_MAGIC "CTESTDS"  // 7 characters plus the terminating zero
+#define DATASET_VERSION 1
+#define DATASET_DATA_OFFSET 4096
+
+// element type codes, so that a reader can reject a file holding a different
+// type than the one it was compiled for
+enum dataset_type
+{
+  DATASET_TYPE_INT32 = 1,
+  DATASET_TYPE_INT64 = 2,
+  DATASET_TYPE_DOUBLE = 3
+};
+
+// the header at the start of the file. Only fixed-width types are used, so
+// that the layout does not depend on the compiler.
+typedef struct dataset_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t element_type;
+  uint32_t element_size;
+  uint32_t padding;
+  int64_t res;
+  int64_t data_offset;
+} dataset_header;
+
+// define a class for testing, including a static member array
+class c_test
+{
+  public:
+
+    // build the table in memory, as in class-static-member-openMP.cpp
+    static void initialize_dataset(int res_arg);
+    // store the table built by initialize_dataset in a file
+    static int write_dataset(const char* filename);
+    // map a table stored by write_dataset, instead of initializing it
+    static int map_dataset(const char* filename);
+    static void deallocate_statics();
+
+    long report_number(long i);
+
+    static const long* dataset; // read-only, since it may point into a mapping
+    static int res;
+
+  protected:
+
+    static long* heap_dataset; // set when the table was built in memory
+    static void* mapping; // set when the table was mapped from a file
+    static size_t mapping_size;
+};
+
+const long* c_test::dataset = NULL;
+int c_test::res = 0;
+long* c_test::heap_dataset = NULL;
+void* c_test::mapping = NULL;
+size_t c_test::mapping_size = 0;
+
+long c_test::report_number(long i)
+{
+  return dataset[i];
+}
+
+void c_test::initialize_dataset(int res_arg)
+{
+  long i;
+
+  res = res_arg;
+  heap_dataset = new long[res];
+
+  printf("initializing data set...\n");
+  #pragma omp parallel for private(i) schedule(static)
+  for (i = 0; i < res; i++)
+  {
+    heap_dataset[i] = i;
+  }
+
+  dataset = heap_dataset;
+}
+
+int c_test::write_dataset(const char* filename)
+{
+  dataset_header h;
+  const char* p;
+  size_t left;
+  ssize_t written;
+  int fd;
+
+  if (dataset == NULL) return -1;
+
+  memset(&h, 0, sizeof(h));
+  strncpy(h.magic, DATASET_MAGIC, sizeof(h.magic));
+  h.version = DATASET_VERSION;
+  h.element_type = DATASET_TYPE_INT64;
+  h.element_size = sizeof(long);
+  h.res = res;
+  h.data_offset = DATASET_DATA_OFFSET;
+
+  // write to a temporary name first and rename at the end, so that readers
+  // never get to see a half-written file
+  char tmpname[4096];
+  snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+
+  fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) { perror(tmpname); return -1; }
+
+  // the header, followed by zeros up to the data offset
+  if (pwrite(fd, &h, sizeof(h), 0) != (ssize_t) sizeof(h)) goto fail;
+  if (ftruncate(fd, DATASET_DATA_OFFSET) != 0) goto fail;
+  if (lseek(fd, DATASET_DATA_OFFSET, SEEK_SET) < 0) goto fail;
+
+  // write may return early for large sizes, so keep going until done
+  p = (const char*) dataset;
+  left = (size_t) res * sizeof(long);
+  while (left > 0)
+  {
+    written = write(fd, p, left);
+    if (written <= 0) goto fail;
+    p += written;
+    left -= written;
+  }
+
+  if (fsync(fd) != 0) goto fail;
+  close(fd);
+
+  if (rename(tmpname, filename) != 0) { perror(filename); return -1; }
+  return 0;
+
+fail:
+  perror(tmpname);
+  close(fd);
+  unlink(tmpname);
+  return -1;
+}
+
+int c_test::map_dataset(const char* filename)
+{
+  const dataset_header* h;
+  struct stat st;
+  void* p;
+  int fd;
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0) { perror(filename); return -1; }
+
+  if (fstat(fd, &st) != 0 || st.st_size < DATASET_DATA_OFFSET)
+  {
+    printf("%s: too small to be a dataset file\n", filename);
+    close(fd);
+    return -1;
+  }
+
+  // MAP_SHARED with PROT_READ: all processes mapping the file share the page
+  // cache pages, and nobody can modify them by accident
+  p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd); // the mapping keeps its own reference to the file
+  if (p == MAP_FAILED) { perror(filename); return -1; }
+
+  h = (const dataset_header*) p;
+  if (strncmp(h->magic, DATASET_MAGIC, sizeof(h->magic)) != 0
+    || h->version != DATASET_VERSION
+    || h->element_type != DATASET_TYPE_INT64
+    || h->element_size != sizeof(long)
+    || h->data_offset != DATASET_DATA_OFFSET
+    || h->res < 0 || h->res > 0x7fffffff
+    || st.st_size < h->data_offset + h->res * (int64_t) sizeof(long))
+  {
+    printf("%s: not a dataset file, or written by an incompatible version\n",
+      filename);
+    munmap(p, st.st_size);
+    return -1;
+  }
+
+  mapping = p;
+  mapping_size = st.st_size;
+  res = h->res;
+  dataset = (const long*) ((const char*) p + h->data_offset);
+
+  return 0;
+}
+
+void c_test::deallocate_statics()
+{
+  if (heap_dataset != NULL) { delete[] heap_dataset; heap_dataset = NULL; }
+  if (mapping != NULL) { munmap(mapping, mapping_size); mapping = NULL; }
+  dataset = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char** argv)
+{
+  double t0, t1, t2;
+  long sum;
+  int i;
+
+  if (argc == 4 && strcmp(argv[1], "write") == 0)
+  {
+    t0 = omp_get_wtime();
+    c_test::initialize_dataset(atoi(argv[3]));
+    t1 = omp_get_wtime();
+    if (c_test::write_dataset(argv[2]) != 0) return 1;
+    t2 = omp_get_wtime();
+
+    printf("initialized %i entries in %f s, wrote %s in %f s\n", c_test::res,
+      t1 - t0, argv[2], t2 - t1);
+
+    c_test::deallocate_statics();
+    return 0;
+  }
+
+  if (argc == 3 && strcmp(argv[1], "read") == 0)
+  {
+    t0 = omp_get_wtime();
+    if (c_test::map_dataset(argv[2]) != 0) return 1;
+    t1 = omp_get_wtime();
+
+    // the first sweep pulls the pages into the page cache if no other
+    // process has done so already
+    sum = 0;
+    #pragma omp parallel for private(i) schedule(static) reduction(+:sum)
+    for (i = 0; i < c_test::res; i++)
+    {
+      c_test C; // create a local instance of the class
+      sum += C.report_number(i);
+    }
+    t2 = omp_get_wtime();
+
+    printf("mapped %i entries in %f s, first sweep took %f s\n", c_test::res,
+      t1 - t0, t2 - t1);
+    printf("sum of entries: %li (expected %li)\n", sum,
+      (long) c_test::res * (c_test::res - 1) / 2);
+    if (c_test::res > 492)
+      printf("entry number 492 is equal to %li\n", c_test::dataset[492]);
+
+    c_test::deallocate_statics();
+    return 0;
+  }
+
+  printf("usage: %s write <file> <res>\n", argv[0]);
+  printf("       %s read <file>\n", argv[0]);
+  return 1;
+}
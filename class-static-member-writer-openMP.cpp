@@ -0,0 +1,404 @@
+// testing classes & static members: writing loop results without false sharing
+//
+// motivation: class-static-member-openMP.cpp fills dataset2 with
+//
+//   #pragma omp parallel for
+//   for (i = 0; i < res; i++) dataset2[i] = C.report_number(i);
+//
+// and admits that this leads to false sharing: as soon as the chunk size is
+// smaller than a cache line (8 longs), neighbouring threads write to the same
+// cache line and keep stealing it from each other's caches. With the default
+// schedule(static) this only happens at the block boundaries, but with
+// schedule(static,1) or schedule(dynamic) it happens on every single write.
+//
+// This snippet adds a writer class that loop bodies hand their results to,
+// instead of writing to the destination directly. It has three modes:
+//
+//   WRITER_DIRECT    store straight into the destination (the original code)
+//   WRITER_BUFFERED  every thread appends (index, value) pairs to its own
+//                    buffer. The per-thread bookkeeping is padded to a full
+//                    cache line, so the threads never share a line while the
+//                    loop runs. At commit time the destination is split into
+//                    one contiguous block per thread, with the boundaries
+//                    rounded to cache lines, and every thread copies the
+//                    entries that fall into its own block out of all the
+//                    buffers. Each destination cache line is therefore written
+//                    by exactly one thread.
+//   WRITER_STREAMING store with non-temporal (streaming) stores, which bypass
+//                    the cache and so avoid reading the destination line in
+//                    before writing it. This pays off for schedule(static),
+//                    where each thread writes whole lines, but not for small
+//                    chunks, where the partial lines are written out one by
+//                    one (the benchmark shows both cases).
+//
+// The buffered mode relies on every thread receiving its iterations in
+// increasing order, which holds for the static, dynamic and guided schedules.
+// If it does not, the buffer gets sorted before the commit.
+//
+// Usage, with commit() called by all threads of the region after the loop:
+//
+//   #pragma omp parallel
+//   {
+//     #pragma omp for schedule(static,1)
+//     for (i = 0; i < res; i++) W.put(i, C.report_number(i));
+//     W.commit();
+//   }
+//
+// compiled with g++ class-static-member-writer-openMP.cpp -fopenmp -O2 -Wall
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <algorithm>
+#include <omp.h>
+#ifdef __SSE2__
+  #include <emmintrin.h>
+#endif
+
+#define CACHE_LINE_SIZE 64
+#define NUM_REPEATS 5
+
+// define a class for testing, including a static member array (as in
+// class-static-member-openMP.cpp)
+class c_test
+{
+  public:
+
+    static void initialize_dataset(int res_arg);
+    static void deallocate_statics();
+
+    long report_number(long i);
+
+    static long* dataset;
+
+  protected:
+
+    static int res;
+};
+
+long* c_test::dataset = NULL;
+int c_test::res = 0;
+
+long c_test::report_number(long i)
+{
+  return dataset[i];
+}
+
+void c_test::initialize_dataset(int res_arg)
+{
+  long i;
+
+  res = res_arg;
+  // aligned, so that the static schedule hands out whole cache lines
+  dataset = (long*) aligned_alloc(CACHE_LINE_SIZE,
+    (res * sizeof(long) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE);
+  if (dataset == NULL)
+  {
+    printf("could not allocate the dataset\n");
+    exit(1);
+  }
+
+  #pragma omp parallel for private(i) schedule(static)
+  for (i = 0; i < res; i++)
+  {
+    dataset[i] = i;
+  }
+}
+
+void c_test::deallocate_statics()
+{
+  if (dataset != NULL) { free(dataset); dataset = NULL; }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+enum writer_mode
+{
+  WRITER_DIRECT,
+  WRITER_BUFFERED,
+  WRITER_STREAMING
+};
+
+const char* writer_mode_name(writer_mode mode)
+{
+  switch (mode)
+  {
+    case WRITER_DIRECT:    return "direct";
+    case WRITER_BUFFERED:  return "buffered";
+    case WRITER_STREAMING: return "streaming";
+  }
+  return "unknown";
+}
+
+// one buffered result
+typedef struct writer_entry
+{
+  long i;
+  long value;
+} writer_entry;
+
+// the per-thread part of the writer. The alignment pads every instance to a
+// full cache line, so that a thread updating its own count never invalidates
+// the line holding another thread's count.
+struct alignas(CACHE_LINE_SIZE) writer_thread_buffer
+{
+  writer_entry* entries;
+  long count;
+  long capacity;
+  long last_i;
+  bool sorted;
+};
+
+class thread_block_writer
+{
+  public:
+
+    thread_block_writer(long* dest_arg, long n_arg, writer_mode mode_arg);
+    ~thread_block_writer();
+
+    void put(long i, long value); // call from inside the loop body
+    void commit(); // call from every thread of the region, after the loop
+
+  protected:
+
+    long* dest;
+    long n;
+    writer_mode mode;
+    int max_threads;
+    writer_thread_buffer* buffers; // one per thread
+
+    void grow(writer_thread_buffer* b);
+    long block_start(int k, int ID_max) const;
+};
+
+thread_block_writer::thread_block_writer(long* dest_arg, long n_arg,
+  writer_mode mode_arg)
+{
+  dest = dest_arg;
+  n = n_arg;
+  mode = mode_arg;
+  max_threads = omp_get_max_threads();
+  buffers = new writer_thread_buffer[max_threads];
+
+  for (int t = 0; t < max_threads; t++)
+  {
+    buffers[t].entries = NULL;
+    buffers[t].count = 0;
+    buffers[t].capacity = 0;
+    buffers[t].last_i = -1;
+    buffers[t].sorted = true;
+  }
+}
+
+thread_block_writer::~thread_block_writer()
+{
+  for (int t = 0; t < max_threads; t++) free(buffers[t].entries);
+  delete[] buffers;
+}
+
+void thread_block_writer::grow(writer_thread_buffer* b)
+{
+  // start from an even share of the destination, double when that runs out
+  long capacity = b->capacity > 0 ? 2 * b->capacity : n / max_threads + 64;
+
+  b->entries = (writer_entry*) realloc(b->entries,
+    capacity * sizeof(writer_entry));
+  if (b->entries == NULL)
+  {
+    printf("thread_block_writer: out of memory\n");
+    exit(1);
+  }
+  b->capacity = capacity;
+}
+
+inline void thread_block_writer::put(long i, long value)
+{
+  if (mode == WRITER_DIRECT)
+  {
+    dest[i] = value;
+    return;
+  }
+
+  if (mode == WRITER_STREAMING)
+  {
+#if defined(__SSE2__) && defined(__x86_64__)
+    _mm_stream_si64((long long*) &dest[i], value);
+#else
+    dest[i] = value;
+#endif
+    return;
+  }
+
+  writer_thread_buffer* b = &buffers[omp_get_thread_num()];
+  if (b->count == b->capacity) grow(b);
+  if (i < b->last_i) b->sorted = false;
+  b->last_i = i;
+  b->entries[b->count].i = i;
+  b->entries[b->count].value = value;
+  b->count++;
+}
+
+static bool entry_less(const writer_entry& a, const writer_entry& b)
+{
+  return a.i < b.i;
+}
+
+// where the block of thread k of ID_max starts in the destination: at an even
+// share, moved up to the next cache line boundary, so that no line is split
+// between two blocks (whatever the alignment of dest)
+long thread_block_writer::block_start(int k, int ID_max) const
+{
+  const long per_line = CACHE_LINE_SIZE / sizeof(long);
+  long first_line = (long) ((CACHE_LINE_SIZE
+    - (uintptr_t) dest % CACHE_LINE_SIZE) % CACHE_LINE_SIZE / sizeof(long));
+
+  if (k == 0) return 0;
+  if (k == ID_max) return n;
+
+  long start = n * k / ID_max;
+  if (start > first_line)
+    start = first_line + (start - first_line + per_line - 1) / per_line * per_line;
+  else
+    start = first_line;
+  return start < n ? start : n;
+}
+
+void thread_block_writer::commit()
+{
+  int my_ID = omp_get_thread_num();
+  int ID_max = omp_get_num_threads();
+
+  if (mode == WRITER_DIRECT)
+  {
+    #pragma omp barrier
+    return;
+  }
+
+  if (mode == WRITER_STREAMING)
+  {
+    // streaming stores are weakly ordered, the fence makes them visible
+    // before the barrier releases the other threads
+#ifdef __SSE2__
+    _mm_sfence();
+#endif
+    #pragma omp barrier
+    return;
+  }
+
+  writer_thread_buffer* mine = &buffers[my_ID];
+  if (!mine->sorted)
+    std::sort(mine->entries, mine->entries + mine->count, entry_less);
+
+  // wait until all threads are done adding to (and sorting) their buffers
+  #pragma omp barrier
+
+  // the block of the destination that this thread is responsible for
+  long lo = block_start(my_ID, ID_max);
+  long hi = block_start(my_ID + 1, ID_max);
+  writer_entry key;
+  key.i = lo;
+
+  for (int t = 0; t < ID_max; t++)
+  {
+    const writer_thread_buffer* b = &buffers[t];
+    const writer_entry* e = std::lower_bound(b->entries,
+      b->entries + b->count, key, entry_less);
+    const writer_entry* end = b->entries + b->count;
+
+    for (; e < end && e->i < hi; e++) dest[e->i] = e->value;
+  }
+
+  // nobody may reset their buffer while others are still reading from it
+  #pragma omp barrier
+  mine->count = 0;
+  mine->last_i = -1;
+  mine->sorted = true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// fill dataset2 through a writer with the given mode, under the schedule
+// currently set with omp_set_schedule. Returns the time taken.
+double fill(long* dataset2, int res, writer_mode mode)
+{
+  thread_block_writer W(dataset2, res, mode);
+  double t0, t1;
+  int i;
+
+  t0 = omp_get_wtime();
+  #pragma omp parallel private(i)
+  {
+    #pragma omp for schedule(runtime) nowait
+    for (i = 0; i < res; i++)
+    {
+      c_test C; // create a local instance of the class
+      W.put(i, C.report_number(i));
+    }
+    W.commit();
+  }
+  t1 = omp_get_wtime();
+
+  return t1 - t0;
+}
+
+int main(int argc, char** argv)
+{
+  int res = 10000000;
+  int i, s, r;
+  writer_mode mode;
+  double t, t_best;
+
+  if (argc > 1) res = atoi(argv[1]);
+
+  omp_sched_t kinds[3] = { omp_sched_static, omp_sched_dynamic,
+    omp_sched_static };
+  int chunks[3] = { 1, 1, 0 }; // 0 means the default chunk size
+  const char* names[3] = { "static,1", "dynamic", "static" };
+
+  c_test::initialize_dataset(res);
+  long* dataset2 = (long*) aligned_alloc(CACHE_LINE_SIZE,
+    (res * sizeof(long) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE);
+  if (dataset2 == NULL)
+  {
+    printf("could not allocate dataset2\n");
+    exit(1);
+  }
+
+  printf("threads: %i, res: %i\n", omp_get_max_threads(), res);
+  printf("%-10s %-10s %12s %10s\n", "schedule", "writer", "time", "GB/s");
+
+  for (s = 0; s < 3; s++)
+  {
+    omp_set_schedule(kinds[s], chunks[s]);
+
+    for (mode = WRITER_DIRECT; mode <= WRITER_STREAMING;
+      mode = (writer_mode) (mode + 1))
+    {
+      t_best = 1e30;
+      for (r = 0; r < NUM_REPEATS; r++)
+      {
+        for (i = 0; i < res; i++) dataset2[i] = -1;
+        t = fill(dataset2, res, mode);
+        if (t < t_best) t_best = t;
+
+        for (i = 0; i < res; i++)
+        {
+          if (dataset2[i] != i)
+          {
+            printf("wrong entry %i: %li\n", i, dataset2[i]);
+            return 1;
+          }
+        }
+      }
+
+      // count one read of dataset and one write of dataset2 per entry
+      printf("%-10s %-10s %10.6f s %10.2f\n", names[s], writer_mode_name(mode),
+        t_best, 2. * res * sizeof(long) / t_best * 1e-9);
+      fflush(stdout);
+    }
+  }
+
+  free(dataset2);
+  c_test::deallocate_statics();
+  return 0;
+}
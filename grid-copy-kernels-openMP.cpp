@@ -0,0 +1,324 @@
+////////////////////////////////////////////////////////////////////////////////
+// host kernels for copying and transforming grids
+//
+// compile with g++ -fopenmp -O2 -Wall grid-copy-kernels-openMP.cpp
+//
+// copyAB in openacc-multi-D-array-pointer.c copies one element at a time in a
+// collapse(2) loop. At production grid sizes such a copy is limited by memory
+// bandwidth, and a regular store has to read every line of B into the cache
+// before it can overwrite it (a 'read for ownership'), so that a copy moves
+// three bytes over the memory bus for every two it needs.
+//
+// This snippet adds a family of host kernels
+//
+//   grid_transform(A, B, op, strategy)   B(i, j) = op(A(i, j))
+//
+// for copies (copy_op) and simple elementwise transforms (scale_op,
+// affine_op). The grid is cut into tiles of whole cache lines that fit in
+// the L2 cache, and the tiles are spread over the OpenMP threads. Within a
+// tile, one of two strategies is used:
+//
+//   GRID_CACHED     regular (vectorized) stores. B stays in the cache, which
+//                   is what we want if the grid fits in the last level cache
+//                   and B will be used again soon.
+//   GRID_STREAMING  every row of the tile is transformed into a small buffer
+//                   that lives in L1, which is then written to B with
+//                   non-temporal (streaming) stores. These bypass the cache,
+//                   so there is no read for ownership and B does not push
+//                   other data out of the cache.
+//
+// GRID_AUTO picks GRID_CACHED if A and B together fit in half of the last
+// level cache (LLC) and GRID_STREAMING otherwise. The LLC size is read from
+// sysconf, or can be set with the environment variable GRID_LLC_BYTES.
+//
+// main() reports the achieved bandwidth for each strategy next to that of a
+// STREAM-style copy (c[i] = a[i] on flat arrays), counting one read and one
+// write per element as STREAM does.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <omp.h>
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+#endif
+
+#define GRID_ALIGNMENT 64
+#define GRID_L2_TILE_BYTES (256 * 1024) // A and B part of a tile, together
+#define GRID_STAGE_DOUBLES 512 // size of the L1 staging buffer, 4 KiB
+#define NUM_REPEATS 5
+
+// a grid with rows of ld doubles, of which the first N_y are used
+typedef struct grid_2D
+{
+  double* data;
+  long N_x;
+  long N_y;
+  long ld;
+} grid_2D;
+
+enum grid_strategy
+{
+  GRID_AUTO,
+  GRID_CACHED,
+  GRID_STREAMING
+};
+
+const char* grid_strategy_name(grid_strategy s)
+{
+  switch (s)
+  {
+    case GRID_AUTO:      return "auto";
+    case GRID_CACHED:    return "cached";
+    case GRID_STREAMING: return "streaming";
+  }
+  return "unknown";
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// elementwise operations
+
+struct copy_op
+{
+  inline double operator()(double a) const { return a; }
+};
+
+struct scale_op
+{
+  double s;
+  inline double operator()(double a) const { return s * a; }
+};
+
+struct affine_op
+{
+  double s, c;
+  inline double operator()(double a) const { return s * a + c; }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+grid_2D allocate_grid(long N_x, long N_y)
+{
+  grid_2D g;
+  void* p = NULL;
+  const long per_line = GRID_ALIGNMENT / sizeof(double);
+
+  g.N_x = N_x;
+  g.N_y = N_y;
+  g.ld = ((N_y + per_line - 1) / per_line) * per_line; // whole cache lines
+  if (posix_memalign(&p, GRID_ALIGNMENT, N_x * g.ld * sizeof(double)) != 0)
+  {
+    printf("could not allocate a %li x %li grid\n", N_x, N_y);
+    exit(1);
+  }
+  g.data = (double*) p;
+
+  return g;
+}
+
+void free_grid(grid_2D* g)
+{
+  free(g->data);
+  g->data = NULL;
+}
+
+long llc_bytes()
+{
+  static long bytes = -1;
+  const char* env;
+
+  if (bytes > 0) return bytes;
+
+  env = getenv("GRID_LLC_BYTES");
+  if (env != NULL) bytes = atol(env);
+#ifdef _SC_LEVEL3_CACHE_SIZE
+  if (bytes <= 0) bytes = sysconf(_SC_LEVEL3_CACHE_SIZE);
+  if (bytes <= 0) bytes = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+  if (bytes <= 0) bytes = 32L * 1024 * 1024; // a guess, if nothing is known
+
+  return bytes;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// one row segment with regular stores
+template <class Op>
+inline void row_cached(const double* a, double* b, long n, const Op& op)
+{
+  #pragma omp simd
+  for (long j = 0; j < n; j++) b[j] = op(a[j]);
+}
+
+// one row segment with streaming stores. b is cache line aligned, since
+// tiles start at whole cache lines.
+template <class Op>
+inline void row_streaming(const double* a, double* b, long n, const Op& op)
+{
+#if defined(__SSE2__)
+  alignas(GRID_ALIGNMENT) double stage[GRID_STAGE_DOUBLES];
+
+  for (long j0 = 0; j0 < n; j0 += GRID_STAGE_DOUBLES)
+  {
+    long m = n - j0 < GRID_STAGE_DOUBLES ? n - j0 : GRID_STAGE_DOUBLES;
+    long j;
+
+    #pragma omp simd
+    for (j = 0; j < m; j++) stage[j] = op(a[j0 + j]);
+
+    for (j = 0; j + 2 <= m; j += 2)
+      _mm_stream_pd(b + j0 + j, _mm_load_pd(stage + j));
+    if (j < m) b[j0 + j] = stage[j];
+  }
+#else
+  row_cached(a, b, n, op);
+#endif
+}
+
+template <class Op>
+void grid_transform(const grid_2D* A, grid_2D* B, const Op& op,
+  grid_strategy strategy)
+{
+  const long per_line = GRID_ALIGNMENT / sizeof(double);
+  long tile_cols, tile_rows, n_tiles_x, n_tiles_y, t;
+
+  if (strategy == GRID_AUTO)
+  {
+    double bytes = 2. * A->N_x * A->ld * sizeof(double);
+    strategy = bytes <= 0.5 * llc_bytes() ? GRID_CACHED : GRID_STREAMING;
+  }
+
+  // tiles are whole cache lines wide (at most a full row, and narrow enough
+  // for at least 8 rows to fit) and as many rows high as fit in
+  // GRID_L2_TILE_BYTES
+  tile_cols = GRID_L2_TILE_BYTES / (2 * sizeof(double) * 8);
+  tile_cols = (tile_cols / per_line) * per_line;
+  if (tile_cols > A->N_y) tile_cols = A->N_y;
+  tile_rows = GRID_L2_TILE_BYTES / (2 * sizeof(double) * tile_cols);
+  if (tile_rows < 1) tile_rows = 1;
+
+  n_tiles_x = (A->N_x + tile_rows - 1) / tile_rows;
+  n_tiles_y = (A->N_y + tile_cols - 1) / tile_cols;
+
+  #pragma omp parallel
+  {
+    #pragma omp for schedule(static) nowait
+    for (t = 0; t < n_tiles_x * n_tiles_y; t++)
+    {
+      long i0 = (t / n_tiles_y) * tile_rows;
+      long j0 = (t % n_tiles_y) * tile_cols;
+      long i1 = i0 + tile_rows < A->N_x ? i0 + tile_rows : A->N_x;
+      long n = j0 + tile_cols < A->N_y ? tile_cols : A->N_y - j0;
+
+      for (long i = i0; i < i1; i++)
+      {
+        const double* a = A->data + i * A->ld + j0;
+        double* b = B->data + i * B->ld + j0;
+
+        if (strategy == GRID_STREAMING)
+          row_streaming(a, b, n, op);
+        else
+          row_cached(a, b, n, op);
+      }
+    }
+
+#if defined(__SSE2__)
+    // streaming stores are weakly ordered: every thread makes its own visible
+    // before the end of the region, after which anybody may read B
+    if (strategy == GRID_STREAMING) _mm_sfence();
+#endif
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the STREAM copy kernel on flat arrays, as a baseline
+void stream_copy(const double* a, double* c, long n)
+{
+  long i;
+
+  #pragma omp parallel for simd schedule(static)
+  for (i = 0; i < n; i++) c[i] = a[i];
+}
+
+int main()
+{
+  const long sizes[] = { 256, 1024, 2048, 4096, 8192 };
+  const int num_sizes = sizeof(sizes) / sizeof(sizes[0]);
+  int s, r, k;
+  long i, j, res;
+  double t0, t, t_best[4];
+
+  printf("threads: %i, LLC: %li bytes\n", omp_get_max_threads(), llc_bytes());
+
+  // first a correctness check of every strategy and operation
+  res = 1000;
+  grid_2D A = allocate_grid(res, res - 3); // a row length with a remainder
+  grid_2D B = allocate_grid(res, res - 3);
+  for (i = 0; i < A.N_x; i++)
+    for (j = 0; j < A.N_y; j++)
+      A.data[i * A.ld + j] = (double) (i * A.N_y + j);
+
+  affine_op affine = { 2., 1. };
+  for (k = GRID_AUTO; k <= GRID_STREAMING; k++)
+  {
+    grid_transform(&A, &B, affine, (grid_strategy) k);
+    for (i = 0; i < A.N_x; i++)
+      for (j = 0; j < A.N_y; j++)
+        if (B.data[i * B.ld + j] != 2. * A.data[i * A.ld + j] + 1.)
+        {
+          printf("%s: wrong value at (%li, %li)\n",
+            grid_strategy_name((grid_strategy) k), i, j);
+          return 1;
+        }
+  }
+  free_grid(&A);
+  free_grid(&B);
+
+  printf("%6s %10s %12s %12s %12s %12s\n", "RES", "MB", "STREAM GB/s",
+    "auto GB/s", "cached GB/s", "stream GB/s");
+
+  copy_op copy;
+  for (s = 0; s < num_sizes; s++)
+  {
+    res = sizes[s];
+    A = allocate_grid(res, res);
+    B = allocate_grid(res, res);
+    long n = A.N_x * A.ld;
+
+    // first touch in parallel, with the same static distribution the
+    // kernels use
+    #pragma omp parallel for schedule(static)
+    for (i = 0; i < n; i++) { A.data[i] = (double) i; B.data[i] = 0.; }
+
+    for (k = 0; k < 4; k++) t_best[k] = 1e30;
+    for (r = 0; r < NUM_REPEATS; r++)
+    {
+      t0 = omp_get_wtime();
+      stream_copy(A.data, B.data, n);
+      t = omp_get_wtime() - t0;
+      if (t < t_best[0]) t_best[0] = t;
+
+      for (k = GRID_AUTO; k <= GRID_STREAMING; k++)
+      {
+        t0 = omp_get_wtime();
+        grid_transform(&A, &B, copy, (grid_strategy) k);
+        t = omp_get_wtime() - t0;
+        if (t < t_best[k + 1]) t_best[k + 1] = t;
+      }
+    }
+
+    double bytes = 2. * n * sizeof(double);
+    printf("%6li %10.1f %12.2f %12.2f %12.2f %12.2f\n", res, bytes * 1e-6,
+      bytes / t_best[0] * 1e-9, bytes / t_best[1] * 1e-9,
+      bytes / t_best[2] * 1e-9, bytes / t_best[3] * 1e-9);
+    fflush(stdout);
+
+    free_grid(&A);
+    free_grid(&B);
+  }
+
+  return 0;
+}
@@ -0,0 +1,550 @@
+////////////////////////////////////////////////////////////////////////////////
+// writing grids to files: raw binary in parallel, and fast text
+//
+// compile with g++ -fopenmp -O2 -Wall grid-dump-openMP.cpp
+// run with ./a.out [N] [directory], for an N x N grid (default 10000, 10^8
+// elements) written to files in directory (default .)
+//
+// openacc-multi-D-array.c and openacc-multi-D-array-pointer.c show their
+// result with
+//
+//   printf("B[%d][%d] = %lf\n", i, j, B[i][j]);
+//
+// per element. That is fine for RES = 10, but for a production grid it takes
+// far longer than computing it: printf parses its format string for every
+// element, converts with the locale in mind, and runs on one thread.
+//
+// This snippet has two faster ways out:
+//
+//   write_grid_binary   a header of GRID_DUMP_ALIGNMENT bytes describing the
+//                       grid (magic, version, byte order, element type and
+//                       size, dimensions), followed by the elements exactly as
+//                       they are in memory. The data is not converted or
+//                       copied: the threads each pwrite chunks of it straight
+//                       from the grid, at their place in the file.
+//                       With GRID_DUMP_DIRECT the file is opened with
+//                       O_DIRECT, which bypasses the page cache (the data goes
+//                       from the grid to the disk by DMA, and does not push
+//                       everything else out of memory). O_DIRECT wants
+//                       aligned buffers, offsets and lengths: the header is
+//                       sized to keep the data aligned, the grid should be
+//                       allocated with GRID_DUMP_ALIGNMENT (otherwise chunks
+//                       go through a bounce buffer), and the unaligned tail
+//                       is written without O_DIRECT. File systems without
+//                       O_DIRECT (tmpfs) get a normal write.
+//   read_grid_binary    checks the header and reads a grid back, in parallel,
+//                       into a 2D array as allocate_2D_array_double makes.
+//   write_grid_text     the same text as the printf loop, byte for byte, but
+//                       formatted with std::to_chars (which rounds exactly as
+//                       printf does), by all threads at once, chunk by chunk.
+//                       The chunks of a round are placed in the file with
+//                       pwrite once their lengths are known.
+//
+// GRID_DUMP_SYNC adds an fsync, so that the time includes getting the data to
+// the disk, not only into the page cache.
+//
+// main() writes the grid with the printf loop, as text and as binary (through
+// the page cache, with fsync, and with O_DIRECT), checks the text against the
+// printf output and the binary file against the grid, and reports times and
+// speedups over printf. The files are removed afterwards.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <charconv>
+#include <omp.h>
+
+#define GRID_DUMP_MAGIC "GRIDDUMP"
+#define GRID_DUMP_VERSION 1
+#define GRID_DUMP_ENDIAN 0x01020304u
+#define GRID_DUMP_ALIGNMENT 4096 // header size, and the O_DIRECT unit
+#define GRID_DUMP_CHUNK (8L << 20) // bytes per pwrite / pread
+#define GRID_TEXT_CHUNK (1L << 18) // elements per text chunk
+
+enum grid_dump_flags
+{
+  GRID_DUMP_DIRECT = 1,
+  GRID_DUMP_SYNC = 2
+};
+
+// the start of the header block; the rest of the block is zero
+typedef struct grid_dump_header
+{
+  char magic[8];          // GRID_DUMP_MAGIC
+  uint32_t version;       // GRID_DUMP_VERSION
+  uint32_t endian;        // GRID_DUMP_ENDIAN, in the writer's byte order
+  uint64_t data_offset;   // where the elements start
+  uint64_t element_bytes; // 8
+  uint64_t N_x;           // rows
+  uint64_t N_y;           // elements per row
+  char element_type[8];   // "double"
+} grid_dump_header;
+
+////////////////////////////////////////////////////////////////////////////////
+// 2D arrays as in openacc-multi-D-array.c, with the block aligned for O_DIRECT
+
+double** allocate_2D_array_double(const long N_x, const long N_y)
+{
+  double **A;
+  void* p = NULL;
+  long i_x;
+
+  A = (double**) malloc(N_x * sizeof(double*));
+  if (A == NULL
+    || posix_memalign(&p, GRID_DUMP_ALIGNMENT, N_x * N_y * sizeof(double)) != 0)
+  {
+    printf("could not allocate a %li x %li array\n", N_x, N_y);
+    exit(1);
+  }
+  A[0] = (double*) p;
+  for (i_x = 0; i_x < N_x; i_x++)
+  {
+    A[i_x] = A[0] + i_x * N_y;
+  }
+
+  return A;
+}
+
+void free_2D_array_double(double **A)
+{
+  free(A[0]);
+  free(A);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// pwrite and pread, continued after partial transfers
+
+static int pwrite_all(int fd, const char* buf, size_t len, off_t offset)
+{
+  while (len > 0)
+  {
+    ssize_t n = pwrite(fd, buf, len, offset);
+    if (n < 0)
+    {
+      if (errno == EINTR) continue;
+      perror("pwrite");
+      return -1;
+    }
+    buf += n;
+    len -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+static int pread_all(int fd, char* buf, size_t len, off_t offset)
+{
+  while (len > 0)
+  {
+    ssize_t n = pread(fd, buf, len, offset);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0)
+    {
+      if (n < 0) perror("pread"); else printf("pread: file too short\n");
+      return -1;
+    }
+    buf += n;
+    len -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// binary
+
+int write_grid_binary(const char* path, const double* data, long N_x, long N_y,
+  int flags)
+{
+  size_t bytes = N_x * N_y * sizeof(double);
+  size_t direct_bytes = bytes;
+  bool direct = (flags & GRID_DUMP_DIRECT) != 0;
+  int errors = 0;
+  int fd = -1;
+
+  if (direct)
+  {
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    if (fd < 0 && errno == EINVAL)
+    {
+      printf("%s: no O_DIRECT on this file system, writing normally\n", path);
+      direct = false;
+    }
+  }
+  if (fd < 0) fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) { perror(path); return -1; }
+
+  // the header, in a block of its own so that the data stays aligned
+  char* block = (char*) aligned_alloc(GRID_DUMP_ALIGNMENT, GRID_DUMP_ALIGNMENT);
+  if (block == NULL)
+  {
+    printf("%s: could not allocate the header block\n", path);
+    close(fd);
+    return -1;
+  }
+  grid_dump_header h;
+  memset(block, 0, GRID_DUMP_ALIGNMENT);
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, GRID_DUMP_MAGIC, 8);
+  h.version = GRID_DUMP_VERSION;
+  h.endian = GRID_DUMP_ENDIAN;
+  h.data_offset = GRID_DUMP_ALIGNMENT;
+  h.element_bytes = sizeof(double);
+  h.N_x = N_x;
+  h.N_y = N_y;
+  strcpy(h.element_type, "double");
+  memcpy(block, &h, sizeof(h));
+  errors += pwrite_all(fd, block, GRID_DUMP_ALIGNMENT, 0) != 0;
+  free(block);
+
+  // setting the size first spares the threads from extending the file, which
+  // would serialize them
+  if (ftruncate(fd, GRID_DUMP_ALIGNMENT + bytes) != 0) perror("ftruncate");
+
+  if (direct) direct_bytes = bytes & ~(size_t) (GRID_DUMP_ALIGNMENT - 1);
+  bool in_place = !direct || (uintptr_t) data % GRID_DUMP_ALIGNMENT == 0;
+  long num_chunks = (direct_bytes + GRID_DUMP_CHUNK - 1) / GRID_DUMP_CHUNK;
+
+  #pragma omp parallel reduction(+:errors)
+  {
+    char* bounce = NULL;
+    if (!in_place)
+      bounce = (char*) aligned_alloc(GRID_DUMP_ALIGNMENT, GRID_DUMP_CHUNK);
+
+    #pragma omp for schedule(dynamic)
+    for (long c = 0; c < num_chunks; c++)
+    {
+      size_t offset = c * GRID_DUMP_CHUNK;
+      size_t len = direct_bytes - offset < (size_t) GRID_DUMP_CHUNK
+        ? direct_bytes - offset : GRID_DUMP_CHUNK;
+      const char* src = (const char*) data + offset;
+
+      if (!in_place && bounce == NULL) { errors++; continue; }
+      if (!in_place) { memcpy(bounce, src, len); src = bounce; }
+      errors += pwrite_all(fd, src, len, GRID_DUMP_ALIGNMENT + offset) != 0;
+    }
+    free(bounce);
+  }
+
+  // the tail that is not a whole block, without O_DIRECT
+  if (direct_bytes < bytes)
+  {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+    errors += pwrite_all(fd, (const char*) data + direct_bytes,
+      bytes - direct_bytes, GRID_DUMP_ALIGNMENT + direct_bytes) != 0;
+  }
+
+  if ((flags & GRID_DUMP_SYNC) && fsync(fd) != 0) { perror("fsync"); errors++; }
+  if (close(fd) != 0) { perror("close"); errors++; }
+  return errors == 0 ? 0 : -1;
+}
+
+// returns NULL, after saying why, if path is not a grid dump of doubles that
+// this machine can read
+double** read_grid_binary(const char* path, long* N_x, long* N_y)
+{
+  grid_dump_header h;
+  struct stat st;
+  int errors = 0;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) { perror(path); return NULL; }
+
+  if (pread_all(fd, (char*) &h, sizeof(h), 0) != 0 || fstat(fd, &st) != 0
+    || memcmp(h.magic, GRID_DUMP_MAGIC, 8) != 0)
+  {
+    printf("%s: not a grid dump\n", path);
+    close(fd);
+    return NULL;
+  }
+  // element_type need not end in a NUL, so all 8 bytes are compared
+  if (h.version != GRID_DUMP_VERSION || h.endian != GRID_DUMP_ENDIAN
+    || h.element_bytes != sizeof(double)
+    || memcmp(h.element_type, "double\0\0", 8) != 0)
+  {
+    printf("%s: version %u, %.8s of %lu bytes, %s byte order: can not read this\n",
+      path, h.version, h.element_type, (unsigned long) h.element_bytes,
+      h.endian == GRID_DUMP_ENDIAN ? "same" : "other");
+    close(fd);
+    return NULL;
+  }
+
+  // the header is not to be trusted: the sizes must not overflow, and the
+  // data has to lie after the header and within the file
+  uint64_t elements, bytes, end;
+  if (h.N_x == 0 || h.N_y == 0 || h.N_x > LONG_MAX || h.N_y > LONG_MAX
+    || __builtin_mul_overflow(h.N_x, h.N_y, &elements)
+    || __builtin_mul_overflow(elements, (uint64_t) sizeof(double), &bytes)
+    || bytes > (uint64_t) LONG_MAX || h.data_offset < sizeof(h)
+    || __builtin_add_overflow(h.data_offset, bytes, &end))
+  {
+    printf("%s: a %lu x %lu grid at offset %lu does not make sense\n", path,
+      (unsigned long) h.N_x, (unsigned long) h.N_y,
+      (unsigned long) h.data_offset);
+    close(fd);
+    return NULL;
+  }
+  if ((uint64_t) st.st_size < end)
+  {
+    printf("%s: %ld bytes, %lu expected\n", path, (long) st.st_size,
+      (unsigned long) end);
+    close(fd);
+    return NULL;
+  }
+
+  *N_x = h.N_x;
+  *N_y = h.N_y;
+  double** A = allocate_2D_array_double(*N_x, *N_y);
+  long num_chunks = (bytes + GRID_DUMP_CHUNK - 1) / GRID_DUMP_CHUNK;
+
+  // every thread reads into (and so first touches) its own chunks
+  #pragma omp parallel for schedule(dynamic) reduction(+:errors)
+  for (long c = 0; c < num_chunks; c++)
+  {
+    size_t offset = c * GRID_DUMP_CHUNK;
+    size_t len = bytes - offset < (size_t) GRID_DUMP_CHUNK ? bytes - offset
+      : GRID_DUMP_CHUNK;
+    errors += pread_all(fd, (char*) A[0] + offset, len,
+      h.data_offset + offset) != 0;
+  }
+
+  close(fd);
+  if (errors > 0) { free_2D_array_double(A); return NULL; }
+  return A;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// text
+
+// the longest line: the name, two indices, the punctuation, and a double in
+// fixed notation (309 digits before the point, 6 after)
+#define GRID_TEXT_MAX_LINE(name_len) ((name_len) + 2 * 20 + 8 + 320)
+
+// appends one line per element of [start, end) to buf, in the format
+// "name[i][j] = %lf\n"
+static void format_chunk(const double* data, long N_y, const char* name,
+  long start, long end, char** buf, size_t* cap, size_t* len)
+{
+  size_t name_len = strlen(name);
+  size_t max_line = GRID_TEXT_MAX_LINE(name_len);
+  char* p = *buf + *len;
+
+  for (long k = start; k < end; k++)
+  {
+    if ((size_t) (*buf + *cap - p) < max_line)
+    {
+      size_t used = p - *buf;
+      *cap = 2 * *cap + max_line;
+      *buf = (char*) realloc(*buf, *cap);
+      if (*buf == NULL)
+      {
+        printf("write_grid_text: could not allocate %zu bytes\n", *cap);
+        exit(1);
+      }
+      p = *buf + used;
+    }
+    char* e = *buf + *cap;
+
+    memcpy(p, name, name_len);
+    p += name_len;
+    *p++ = '[';
+    p = std::to_chars(p, e, k / N_y).ptr;
+    *p++ = ']';
+    *p++ = '[';
+    p = std::to_chars(p, e, k % N_y).ptr;
+    memcpy(p, "] = ", 4);
+    p += 4;
+    p = std::to_chars(p, e, data[k], std::chars_format::fixed, 6).ptr;
+    *p++ = '\n';
+  }
+  *len = p - *buf;
+}
+
+int write_grid_text(const char* path, const double* data, long N_x, long N_y,
+  const char* name, int flags)
+{
+  long n = N_x * N_y;
+  long num_chunks = (n + GRID_TEXT_CHUNK - 1) / GRID_TEXT_CHUNK;
+  int slots = omp_get_max_threads();
+  int errors = 0;
+  off_t base = 0;
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) { perror(path); return -1; }
+
+  // one buffer per slot of a round; slot s is formatted and written by
+  // thread s, so the buffers stay with their threads
+  char** bufs = (char**) calloc(slots, sizeof(char*));
+  size_t* caps = (size_t*) calloc(slots, sizeof(size_t));
+  size_t* lens = (size_t*) calloc(slots, sizeof(size_t));
+  off_t* offsets = (off_t*) calloc(slots, sizeof(off_t));
+
+  #pragma omp parallel num_threads(slots) reduction(+:errors)
+  {
+    for (long round = 0; round < num_chunks; round += slots)
+    {
+      #pragma omp for schedule(static, 1)
+      for (int s = 0; s < slots; s++)
+      {
+        long c = round + s;
+        lens[s] = 0;
+        if (c < num_chunks)
+        {
+          long end = (c + 1) * GRID_TEXT_CHUNK < n ? (c + 1) * GRID_TEXT_CHUNK : n;
+          format_chunk(data, N_y, name, c * GRID_TEXT_CHUNK, end, &bufs[s],
+            &caps[s], &lens[s]);
+        }
+      }
+
+      // now that the lengths are known, so are the places in the file
+      #pragma omp single
+      {
+        for (int s = 0; s < slots; s++)
+        {
+          offsets[s] = base;
+          base += lens[s];
+        }
+      }
+
+      #pragma omp for schedule(static, 1)
+      for (int s = 0; s < slots; s++)
+      {
+        if (lens[s] > 0) errors += pwrite_all(fd, bufs[s], lens[s], offsets[s]) != 0;
+      }
+    }
+  }
+
+  for (int s = 0; s < slots; s++) free(bufs[s]);
+  free(bufs);
+  free(caps);
+  free(lens);
+  free(offsets);
+
+  if ((flags & GRID_DUMP_SYNC) && fsync(fd) != 0) { perror("fsync"); errors++; }
+  if (close(fd) != 0) { perror("close"); errors++; }
+  return errors == 0 ? 0 : -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the loop of openacc-multi-D-array.c
+int write_grid_printf(const char* path, double** B, long N_x, long N_y)
+{
+  FILE* f = fopen(path, "w");
+  if (f == NULL) { perror(path); return -1; }
+
+  for (long i = 0; i < N_x; i++)
+    for (long j = 0; j < N_y; j++)
+      fprintf(f, "B[%ld][%ld] = %lf\n", i, j, B[i][j]);
+
+  return fclose(f) == 0 ? 0 : -1;
+}
+
+static bool files_equal(const char* path_a, const char* path_b)
+{
+  FILE* a = fopen(path_a, "r");
+  FILE* b = fopen(path_b, "r");
+  bool equal = a != NULL && b != NULL;
+  static char buf_a[1 << 20], buf_b[1 << 20];
+
+  while (equal)
+  {
+    size_t n_a = fread(buf_a, 1, sizeof(buf_a), a);
+    size_t n_b = fread(buf_b, 1, sizeof(buf_b), b);
+    equal = n_a == n_b && memcmp(buf_a, buf_b, n_a) == 0;
+    if (n_a == 0) break;
+  }
+  if (a != NULL) fclose(a);
+  if (b != NULL) fclose(b);
+  return equal;
+}
+
+static long file_size(const char* path)
+{
+  struct stat st;
+  return stat(path, &st) == 0 ? (long) st.st_size : -1;
+}
+
+static void report(const char* what, const char* path, double t, double t_printf)
+{
+  printf("%-26s %9.3f s %9.3f GB/s %9.1fx\n", what, t,
+    1e-9 * file_size(path) / t, t_printf / t);
+}
+
+int main(int argc, char** argv)
+{
+  long N = argc > 1 ? atol(argv[1]) : 10000;
+  const char* dir = argc > 2 ? argv[2] : ".";
+  char path_printf[4096], path_text[4096], path_binary[4096];
+  int errors = 0;
+  double t0, t_printf;
+
+  snprintf(path_printf, sizeof(path_printf), "%s/B-printf.txt", dir);
+  snprintf(path_text, sizeof(path_text), "%s/B.txt", dir);
+  snprintf(path_binary, sizeof(path_binary), "%s/B.grid", dir);
+
+  // B as copyAB leaves it
+  double** B = allocate_2D_array_double(N, N);
+  #pragma omp parallel for
+  for (long i = 0; i < N; i++)
+    for (long j = 0; j < N; j++)
+      B[i][j] = (double) (i * N + j);
+
+  printf("%ld x %ld grid (%.2f GB) to %s, %d threads\n", N, N,
+    1e-9 * N * N * sizeof(double), dir, omp_get_max_threads());
+  printf("%-26s %11s %14s %10s\n", "", "time", "file bytes/s", "speedup");
+
+  t0 = omp_get_wtime();
+  errors += write_grid_printf(path_printf, B, N, N) != 0;
+  t_printf = omp_get_wtime() - t0;
+  report("printf per element", path_printf, t_printf, t_printf);
+
+  t0 = omp_get_wtime();
+  errors += write_grid_text(path_text, B[0], N, N, "B", 0) != 0;
+  report("text, to_chars", path_text, omp_get_wtime() - t0, t_printf);
+  if (!files_equal(path_text, path_printf))
+  {
+    printf("  the text differs from the printf output\n");
+    errors++;
+  }
+  unlink(path_printf);
+  unlink(path_text);
+
+  const char* names[] = { "binary", "binary + fsync", "binary, O_DIRECT + fsync" };
+  const int flags[] = { 0, GRID_DUMP_SYNC, GRID_DUMP_DIRECT | GRID_DUMP_SYNC };
+  for (int m = 0; m < 3; m++)
+  {
+    t0 = omp_get_wtime();
+    errors += write_grid_binary(path_binary, B[0], N, N, flags[m]) != 0;
+    report(names[m], path_binary, omp_get_wtime() - t0, t_printf);
+  }
+
+  long N_x, N_y;
+  t0 = omp_get_wtime();
+  double** C = read_grid_binary(path_binary, &N_x, &N_y);
+  double t_read = omp_get_wtime() - t0;
+  if (C == NULL || N_x != N || N_y != N
+    || memcmp(C[0], B[0], N * N * sizeof(double)) != 0)
+  {
+    printf("the grid read back differs\n");
+    errors++;
+  }
+  else
+  {
+    printf("%-26s %9.3f s %9.3f GB/s\n", "read back", t_read,
+      1e-9 * file_size(path_binary) / t_read);
+  }
+  if (C != NULL) free_2D_array_double(C);
+  unlink(path_binary);
+
+  free_2D_array_double(B);
+  return errors != 0;
+}
@@ -0,0 +1,356 @@
+////////////////////////////////////////////////////////////////////////////////
+// multi-field grids with a choice of memory layout
+//
+// compile with g++ -fopenmp -O2 -march=native -Wall grid-layout-openMP.cpp
+// run with ./a.out [N], for an N x N grid (default 1024)
+//
+// The grid struct of openacc-multi-D-array-pointer.c holds its two fields A
+// and B as separate double** arrays. Real grids carry 5 to 20 fields per
+// cell, and how to lay those out depends on the kernel:
+//
+//   LAYOUT_AOS    array of structs: all fields of a cell next to each other.
+//                 Good for kernels that use every field of a cell, as one
+//                 cache line brings in a whole cell; wasteful for kernels that
+//                 use one or two fields, which then read the others for
+//                 nothing, and the fields of neighbouring cells are strided,
+//                 so loops over cells vectorize poorly.
+//   LAYOUT_SOA    struct of arrays: one array per field, as the grid struct
+//                 has. Field-wise loops read exactly what they need, with unit
+//                 stride, but a cell-wise kernel reads as many streams at once
+//                 as there are fields, which the hardware prefetcher and the
+//                 TLB keep up with less well.
+//   LAYOUT_AOSOA  array of structs of arrays: blocks of Width cells (a SIMD
+//                 register of doubles), and within a block one short array
+//                 per field. Unit stride within a block, and all fields of a
+//                 cell within Fields * Width * 8 bytes of each other.
+//
+//   field_grid<T, Fields, Layout, Width>
+//
+// is one aligned block of N_x * N_y cells (rounded up to whole blocks of
+// Width cells) of Fields values of type T, laid out by Layout, which is a
+// template parameter, so that every index computation is inlined and, for
+// AoSoA, the division by Width is a shift. All layouts share one interface:
+//
+//   G(f, i, j)       field f of cell (i, j), for loops such as copyAB's
+//   G.cell(f, c)     the same, by flat cell index c = i * N_y + j
+//   G.block(f, b)    field f of the Width cells of block b, at
+//                    G.block(f, b)[l * G.cell_stride], l = 0 ... Width - 1
+//
+// G(f, i, j) keeps the loop of openacc-multi-D-array-pointer.c as it is, but
+// the compiler does not vectorize it: the collapse(2) hides the rows from it,
+// and for AoSoA it does not see that consecutive j are consecutive in memory.
+// Kernels written over blocks (the *_blocks kernels below) do vectorize, for
+// every layout: cell_stride is 1 for SoA and AoSoA, and Fields for AoS.
+//
+// main() runs a field-wise kernel (copyAB: B = A, two of the fields) and a
+// cell-wise one (B = a weighted sum of all other fields) over each layout,
+// written both ways, checks the results and reports the bandwidth of the
+// bytes the kernel needs.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <omp.h>
+
+#define LAYOUT_ALIGNMENT 64
+#define LAYOUT_SIMD_WIDTH 8 // doubles in a 512 bit register
+#define NUM_FIELDS 8
+#define NUM_REPEATS 5
+
+enum grid_layout
+{
+  LAYOUT_AOS,
+  LAYOUT_SOA,
+  LAYOUT_AOSOA
+};
+
+const char* grid_layout_name(grid_layout l)
+{
+  switch (l)
+  {
+    case LAYOUT_AOS:   return "AoS";
+    case LAYOUT_SOA:   return "SoA";
+    case LAYOUT_AOSOA: return "AoSoA";
+  }
+  return "unknown";
+}
+
+template <class T, int Fields, grid_layout Layout,
+  int Width = LAYOUT_SIMD_WIDTH>
+class field_grid
+{
+  public:
+
+    static_assert((Width & (Width - 1)) == 0, "Width must be a power of two");
+
+    typedef T value_type;
+    static const int num_fields = Fields;
+    static const int width = Width;
+    static const grid_layout layout = Layout;
+    // the distance between one field of neighbouring cells within a block
+    static const long cell_stride = Layout == LAYOUT_AOS ? Fields : 1;
+
+    field_grid(long N_x_arg, long N_y_arg) : N_x(N_x_arg), N_y(N_y_arg)
+    {
+      n_blocks = (N_x * N_y + Width - 1) / Width;
+      n_padded = n_blocks * Width;
+
+      void* p = NULL;
+      if (posix_memalign(&p, LAYOUT_ALIGNMENT,
+        n_padded * Fields * sizeof(T)) != 0)
+      {
+        printf("field_grid: could not allocate %li cells\n", n_padded);
+        exit(1);
+      }
+      buffer = (T*) p;
+
+      // zeroed by the threads that will work on the blocks, so that padding
+      // cells hold defined values and pages are placed near their threads
+      #pragma omp parallel for schedule(static)
+      for (long b = 0; b < n_blocks; b++)
+        for (int f = 0; f < Fields; f++)
+          for (int l = 0; l < Width; l++)
+            block(f, b)[l * cell_stride] = T();
+    }
+
+    ~field_grid() { free(buffer); }
+
+    field_grid(const field_grid&) = delete;
+    field_grid& operator=(const field_grid&) = delete;
+
+    inline T& operator()(int f, long i, long j)
+    {
+      return buffer[offset(f, i * N_y + j)];
+    }
+    inline const T& operator()(int f, long i, long j) const
+    {
+      return buffer[offset(f, i * N_y + j)];
+    }
+    inline T& cell(int f, long c) { return buffer[offset(f, c)]; }
+    inline const T& cell(int f, long c) const { return buffer[offset(f, c)]; }
+    inline T* block(int f, long b) { return buffer + offset(f, b * Width); }
+    inline const T* block(int f, long b) const
+    {
+      return buffer + offset(f, b * Width);
+    }
+
+    long size_x() const { return N_x; }
+    long size_y() const { return N_y; }
+    long cells() const { return N_x * N_y; }
+    long blocks() const { return n_blocks; }
+    // the whole block, for data clauses: bytes() bytes from data()
+    T* data() { return buffer; }
+    const T* data() const { return buffer; }
+    long bytes() const { return n_padded * Fields * sizeof(T); }
+
+  protected:
+
+    T* buffer;
+    long N_x;
+    long N_y;
+    long n_blocks;
+    long n_padded; // cells, rounded up to whole blocks
+
+    inline long offset(int f, long c) const
+    {
+      if constexpr (Layout == LAYOUT_AOS)
+        return c * Fields + f;
+      else if constexpr (Layout == LAYOUT_SOA)
+        return f * n_padded + c;
+      else
+      {
+        unsigned long u = c; // unsigned, so that / and % are a shift and a mask
+        return (long) ((u / Width) * (Width * Fields) + f * Width + u % Width);
+      }
+    }
+};
+
+// the fields of the grid struct of openacc-multi-D-array-pointer.c come first
+enum { FIELD_A, FIELD_B };
+
+////////////////////////////////////////////////////////////////////////////////
+// kernels, each with the (i, j) loop of openacc-multi-D-array-pointer.c and
+// over blocks
+
+// field-wise: B = A
+template <class G>
+void copyAB(G& g)
+{
+  long i, j;
+
+  #pragma omp parallel for private(j) collapse(2) schedule(static)
+  for (i = 0; i < g.size_x(); i++)
+    for (j = 0; j < g.size_y(); j++)
+      g(FIELD_B, i, j) = g(FIELD_A, i, j);
+}
+
+template <class G>
+void copyAB_blocks(G& g)
+{
+  const long s = G::cell_stride;
+
+  #pragma omp parallel for schedule(static)
+  for (long b = 0; b < g.blocks(); b++)
+  {
+    const typename G::value_type* a = g.block(FIELD_A, b);
+    typename G::value_type* out = g.block(FIELD_B, b);
+
+    #pragma omp simd
+    for (int l = 0; l < G::width; l++) out[l * s] = a[l * s];
+  }
+}
+
+// the weight of field f in the cell-wise kernel
+static inline double weight(int f) { return f + 1.; }
+
+// cell-wise: B = the weighted sum of all other fields
+template <class G>
+void combine(G& g)
+{
+  long i, j;
+
+  #pragma omp parallel for private(j) collapse(2) schedule(static)
+  for (i = 0; i < g.size_x(); i++)
+    for (j = 0; j < g.size_y(); j++)
+    {
+      typename G::value_type sum = 0.;
+      for (int f = 0; f < G::num_fields; f++)
+        if (f != FIELD_B) sum += weight(f) * g(f, i, j);
+      g(FIELD_B, i, j) = sum;
+    }
+}
+
+template <class G>
+void combine_blocks(G& g)
+{
+  const long s = G::cell_stride;
+
+  #pragma omp parallel for schedule(static)
+  for (long b = 0; b < g.blocks(); b++)
+  {
+    typename G::value_type sum[G::width] = {};
+
+    for (int f = 0; f < G::num_fields; f++)
+    {
+      if (f == FIELD_B) continue;
+      const typename G::value_type* p = g.block(f, b);
+      #pragma omp simd
+      for (int l = 0; l < G::width; l++) sum[l] += weight(f) * p[l * s];
+    }
+
+    typename G::value_type* out = g.block(FIELD_B, b);
+    #pragma omp simd
+    for (int l = 0; l < G::width; l++) out[l * s] = sum[l];
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the initial value of field f of cell c: small integers, so that the sums of
+// the cell-wise kernel are exact in any order
+static inline double initial(int f, long c)
+{
+  return (double) ((c * 7 + f * 13) % 1024);
+}
+
+template <class G>
+void initialize(G& g)
+{
+  #pragma omp parallel for schedule(static)
+  for (long c = 0; c < g.cells(); c++)
+    for (int f = 0; f < G::num_fields; f++)
+      g.cell(f, c) = initial(f, c);
+}
+
+// returns the number of cells where B is wrong
+template <class G>
+long check(const G& g, bool cell_wise)
+{
+  long wrong = 0;
+
+  #pragma omp parallel for reduction(+:wrong) schedule(static)
+  for (long c = 0; c < g.cells(); c++)
+  {
+    double expected = initial(FIELD_A, c);
+    if (cell_wise)
+    {
+      expected = 0.;
+      for (int f = 0; f < G::num_fields; f++)
+        if (f != FIELD_B) expected += weight(f) * initial(f, c);
+    }
+    wrong += g.cell(FIELD_B, c) != expected;
+  }
+  return wrong;
+}
+
+template <class G, class K>
+double best_time(G& g, K kernel)
+{
+  double t = 1e30;
+
+  for (int r = 0; r < NUM_REPEATS; r++)
+  {
+    double t0 = omp_get_wtime();
+    kernel(g);
+    double t1 = omp_get_wtime() - t0;
+    if (t1 < t) t = t1;
+  }
+  return t;
+}
+
+// runs the four kernels on one layout, and prints a row of GB/s
+template <grid_layout Layout>
+int run(long N)
+{
+  typedef field_grid<double, NUM_FIELDS, Layout> grid_type;
+  grid_type g(N, N);
+  int errors = 0;
+  double t[4];
+
+  // useful bytes: A read and B written, or all fields read and B written
+  const size_t size = sizeof(typename grid_type::value_type);
+  double bytes_field = 2. * g.cells() * size;
+  double bytes_cell = (double) NUM_FIELDS * g.cells() * size;
+
+  initialize(g);
+  t[0] = best_time(g, copyAB<grid_type>);
+  errors += check(g, false) != 0;
+
+  initialize(g);
+  t[1] = best_time(g, copyAB_blocks<grid_type>);
+  errors += check(g, false) != 0;
+
+  initialize(g);
+  t[2] = best_time(g, combine<grid_type>);
+  errors += check(g, true) != 0;
+
+  initialize(g);
+  t[3] = best_time(g, combine_blocks<grid_type>);
+  errors += check(g, true) != 0;
+
+  printf("%-8s %14.2f %14.2f %14.2f %14.2f %s\n", grid_layout_name(Layout),
+    1e-9 * bytes_field / t[0], 1e-9 * bytes_field / t[1],
+    1e-9 * bytes_cell / t[2], 1e-9 * bytes_cell / t[3],
+    errors == 0 ? "" : "WRONG");
+  return errors;
+}
+
+int main(int argc, char** argv)
+{
+  long N = argc > 1 ? atol(argv[1]) : 1024;
+  int errors = 0;
+
+  printf("%ld x %ld cells, %d fields of double (%.1f MB), blocks of %d cells, "
+    "%d threads\n", N, N, NUM_FIELDS, 1e-6 * N * N * NUM_FIELDS * sizeof(double),
+    LAYOUT_SIMD_WIDTH, omp_get_max_threads());
+  printf("GB/s of the bytes each kernel needs, best of %d\n", NUM_REPEATS);
+  printf("%-8s %14s %14s %14s %14s\n", "layout", "copyAB (i,j)", "copyAB blk",
+    "combine (i,j)", "combine blk");
+
+  errors += run<LAYOUT_AOS>(N);
+  errors += run<LAYOUT_SOA>(N);
+  errors += run<LAYOUT_AOSOA>(N);
+
+  return errors != 0;
+}
@@ -0,0 +1,522 @@
+////////////////////////////////////////////////////////////////////////////////
+// testing grids stored in reduced precision, computed on in double
+//
+// compile with g++ -fopenmp -O2 -march=native -Wall grid-reduced-precision-openMP.cpp
+// run with ./a.out [N], for an N x N grid (default 4096)
+//
+// grid::X in openacc-present-test.cpp and A and B in the multi-D snippets are
+// arrays of double, so every sweep over them and every update device/self
+// moves 8 bytes per element. Sweeps of this kind are limited by memory
+// bandwidth, not by arithmetic, and many fields do not need 16 digits.
+//
+// reduced_grid<Format> stores its elements in one of the formats
+//
+//   format_double     8 bytes, as before
+//   format_float      4 bytes, IEEE single
+//   format_bf16       2 bytes, bfloat16: the upper half of a float. Same
+//                     range as float, 8 significant bits.
+//   format_fp16       2 bytes, IEEE half: 11 significant bits, but only up
+//                     to 65504, with subnormals below 6.1e-5
+//   format_fixed<I>   an integer I (int16_t, int32_t) holding x / scale,
+//                     with a fixed absolute error instead of a relative one,
+//                     saturating outside the range of I (NaN is stored
+//                     as 0)
+//
+// Compute stays in double: a kernel loads a block of elements into a small
+// buffer of doubles (in L1), works on that, and stores the block back. The
+// load and store of every format are plain loops over the block, written
+// without branches (bf16 and fp16 are converted in software, with integer
+// operations on the bits of a float) so that they vectorize under
+// '#pragma omp simd'. On hardware with F16C or AVX512-BF16 the compiler can
+// be told to use those instead (-mf16c, _Float16), but the software version
+// runs everywhere. It does need wide vectors to pay off: with the SSE2 that
+// x86-64 assumes by default, the fp16 and fixed point conversions cost more
+// time than they save in bandwidth, hence -march=native.
+//
+// Rounding is to nearest (even) in all formats. bf16 and fp16 are rounded
+// from double via float, which can round twice; the extra error is at most
+// one unit of float (2^-24 relative) and is included in the bound below.
+//
+// main() reports, for each format, the bytes per element (which is also
+// what an update device/self of the grid would move), the error bound and
+// the largest error actually found when storing a smooth field, and the time
+// of a sweep B = a A + b over the grid relative to double.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+
+#define BLOCK 1024 // doubles in the compute buffer of a thread, 8 KiB
+#define NUM_REPEATS 5
+
+////////////////////////////////////////////////////////////////////////////////
+// bits of a float, for the software conversions. memcpy of 4 bytes compiles to
+// a register move, and vectorizes.
+
+static inline uint32_t float_bits(float f)
+{
+  uint32_t u;
+  memcpy(&u, &f, 4);
+  return u;
+}
+
+static inline float bits_float(uint32_t u)
+{
+  float f;
+  memcpy(&f, &u, 4);
+  return f;
+}
+
+// all ones if c, zero otherwise
+static inline uint32_t mask(bool c)
+{
+  return -(uint32_t) c;
+}
+
+static inline uint32_t select(bool c, uint32_t a, uint32_t b)
+{
+  return (mask(c) & a) | (~mask(c) & b);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// the formats. Every format has
+//
+//   typedef ... storage;
+//   void load(const storage* s, double* x, long n) const;
+//   void store(const double* x, storage* s, long n) const;
+//   const char* name() const;
+//   double relative_bound() const;  largest |error| / |x|, in range
+//   double absolute_bound() const;  largest |error|, in range
+
+class format_double
+{
+  public:
+
+    typedef double storage;
+
+    void load(const storage* s, double* x, long n) const
+    {
+      memcpy(x, s, n * sizeof(double));
+    }
+    void store(const double* x, storage* s, long n) const
+    {
+      memcpy(s, x, n * sizeof(double));
+    }
+
+    const char* name() const { return "double"; }
+    double relative_bound() const { return 0.; }
+    double absolute_bound() const { return 0.; }
+};
+
+class format_float
+{
+  public:
+
+    typedef float storage;
+
+    void load(const storage* s, double* x, long n) const
+    {
+      #pragma omp simd
+      for (long k = 0; k < n; k++) x[k] = s[k];
+    }
+    void store(const double* x, storage* s, long n) const
+    {
+      #pragma omp simd
+      for (long k = 0; k < n; k++) s[k] = (float) x[k];
+    }
+
+    const char* name() const { return "float"; }
+    double relative_bound() const { return ldexp(1., -24); }
+    double absolute_bound() const { return INFINITY; }
+};
+
+// NaN is not kept apart: rounding can turn a NaN with only low mantissa bits
+// into infinity. Grids with NaNs in them should use float.
+class format_bf16
+{
+  public:
+
+    typedef uint16_t storage;
+
+    void load(const storage* s, double* x, long n) const
+    {
+      #pragma omp simd
+      for (long k = 0; k < n; k++) x[k] = bits_float((uint32_t) s[k] << 16);
+    }
+    void store(const double* x, storage* s, long n) const
+    {
+      #pragma omp simd
+      for (long k = 0; k < n; k++)
+      {
+        uint32_t u = float_bits((float) x[k]);
+        u += 0x7fff + ((u >> 16) & 1); // round to nearest even
+        s[k] = (uint16_t) (u >> 16);
+      }
+    }
+
+    const char* name() const { return "bf16"; }
+    double relative_bound() const { return ldexp(1., -8) + ldexp(1., -24); }
+    double absolute_bound() const { return INFINITY; }
+};
+
+// after F. Giesen's branchless conversions, with the branches written as
+// bit masks (GCC does not if-convert the nested selects at -O2)
+class format_fp16
+{
+  public:
+
+    typedef uint16_t storage;
+
+    void load(const storage* s, double* x, long n) const
+    {
+      const uint32_t shifted_exp = 0x7c00 << 13;
+      const float magic = bits_float(113 << 23);
+
+      #pragma omp simd
+      for (long k = 0; k < n; k++)
+      {
+        uint32_t h = s[k];
+        uint32_t o = (h & 0x7fff) << 13; // exponent and mantissa
+        uint32_t exp = o & shifted_exp;
+        o += (127 - 15) << 23; // rebias the exponent
+
+        // infinity and NaN: the largest exponent of float
+        o += mask(exp == shifted_exp) & ((128 - 16) << 23);
+        // zero and subnormals: renormalized by a float subtraction
+        uint32_t sub = float_bits(bits_float(o + (1 << 23)) - magic);
+        o = select(exp == 0, sub, o);
+
+        x[k] = bits_float(o | ((h & 0x8000) << 16));
+      }
+    }
+
+    void store(const double* x, storage* s, long n) const
+    {
+      const uint32_t f32_inf = 255 << 23;
+      const uint32_t f16_max = (127 + 16) << 23;
+      const uint32_t denorm_magic = ((127 - 15) + (23 - 10) + 1) << 23;
+
+      #pragma omp simd
+      for (long k = 0; k < n; k++)
+      {
+        uint32_t u = float_bits((float) x[k]);
+        uint32_t sign = u & 0x80000000u;
+        u ^= sign;
+
+        // too large: infinity, or a NaN
+        uint32_t big = 0x7c00 | (mask(u > f32_inf) & 0x200);
+        // subnormal in half: let the float adder do the rounding
+        uint32_t small = float_bits(bits_float(u) + bits_float(denorm_magic))
+          - denorm_magic;
+        // normal: rebias, and round to nearest even
+        uint32_t normal = (u + ((uint32_t) (15 - 127) << 23) + 0xfff
+          + ((u >> 13) & 1)) >> 13;
+
+        uint32_t o = select(u >= f16_max, big,
+          select(u < (113u << 23), small, normal));
+        s[k] = (uint16_t) (o | (sign >> 16));
+      }
+    }
+
+    const char* name() const { return "fp16"; }
+    // for |x| between 2^-14 and 65504; below that, the absolute bound of the
+    // subnormals applies
+    double relative_bound() const { return ldexp(1., -11) + ldexp(1., -24); }
+    double absolute_bound() const { return ldexp(1., -25); }
+};
+
+// x is stored as the integer nearest to x / scale
+template <class I>
+class format_fixed
+{
+  public:
+
+    typedef I storage;
+
+    format_fixed(double scale_arg) : scale(scale_arg), inv_scale(1. / scale_arg)
+    {
+    }
+
+    void load(const storage* s, double* x, long n) const
+    {
+      #pragma omp simd
+      for (long k = 0; k < n; k++) x[k] = s[k] * scale;
+    }
+    void store(const double* x, storage* s, long n) const
+    {
+      const double lo = (double) min_value(), hi = (double) max_value();
+
+      #pragma omp simd
+      for (long k = 0; k < n; k++)
+      {
+        double y = x[k] * inv_scale;
+        y = y == y ? y : 0.; // NaN has no integer, it is stored as 0
+        y = y < lo ? lo : y; // saturate
+        y = y > hi ? hi : y;
+        // ties to even in the default rounding mode. y is then a whole number
+        // within the range of I, so the conversion is exact.
+        s[k] = (I) nearbyint(y);
+      }
+    }
+
+    const char* name() const
+    {
+      return sizeof(I) == 2 ? "fixed16" : "fixed32";
+    }
+    double relative_bound() const { return INFINITY; }
+    double absolute_bound() const { return .5 * scale; }
+
+    // the largest |x| that is stored without saturating
+    double range() const { return max_value() * scale; }
+
+  protected:
+
+    double scale;
+    double inv_scale;
+
+    static long max_value() { return (1L << (8 * sizeof(I) - 1)) - 1; }
+    static long min_value() { return -max_value() - 1; }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// the grid: N_x rows of N_y elements, contiguous, as the multi-D snippets
+// allocate them
+
+template <class Format>
+class reduced_grid
+{
+  public:
+
+    typedef typename Format::storage storage;
+
+    long N_x;
+    long N_y;
+    storage* data;
+    Format format;
+
+    reduced_grid(long N_x_arg, long N_y_arg, const Format& format_arg)
+      : N_x(N_x_arg), N_y(N_y_arg), format(format_arg)
+    {
+      data = (storage*) malloc(N_x * N_y * sizeof(storage));
+    }
+    ~reduced_grid() { free(data); }
+
+    reduced_grid(const reduced_grid&) = delete;
+    reduced_grid& operator=(const reduced_grid&) = delete;
+
+    long size() const { return N_x * N_y; }
+    long bytes() const { return size() * sizeof(storage); }
+
+    // single elements, for code that is not worth blocking
+    double get(long i, long j) const
+    {
+      double x;
+      format.load(&data[i * N_y + j], &x, 1);
+      return x;
+    }
+    void set(long i, long j, double x)
+    {
+      format.store(&x, &data[i * N_y + j], 1);
+    }
+
+    // n elements from flat index k, into or from doubles
+    void load(long k, double* x, long n) const { format.load(&data[k], x, n); }
+    void store(long k, const double* x, long n) { format.store(x, &data[k], n); }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// kernels. Every thread works through its blocks with a buffer of doubles of
+// its own.
+
+// G(i, j) = f(i, j), from a double function of the position
+template <class Format, class F>
+void fill(reduced_grid<Format>& G, F f)
+{
+  #pragma omp parallel
+  {
+    double x[BLOCK];
+
+    #pragma omp for schedule(static)
+    for (long i = 0; i < G.N_x; i++)
+    {
+      for (long j0 = 0; j0 < G.N_y; j0 += BLOCK)
+      {
+        long n = G.N_y - j0 < BLOCK ? G.N_y - j0 : BLOCK;
+        for (long j = 0; j < n; j++) x[j] = f(i, j0 + j);
+        G.store(i * G.N_y + j0, x, n);
+      }
+    }
+  }
+}
+
+// B = a A + b
+template <class Format>
+void sweep(const reduced_grid<Format>& A, reduced_grid<Format>& B, double a,
+  double b)
+{
+  long size = A.size();
+
+  #pragma omp parallel
+  {
+    double x[BLOCK];
+
+    #pragma omp for schedule(static)
+    for (long k = 0; k < size; k += BLOCK)
+    {
+      long n = size - k < BLOCK ? size - k : BLOCK;
+      A.load(k, x, n);
+      #pragma omp simd
+      for (long l = 0; l < n; l++) x[l] = a * x[l] + b;
+      B.store(k, x, n);
+    }
+  }
+}
+
+// largest absolute and relative differences between G and f, the latter over
+// the elements with |f| >= floor only
+template <class Format, class F>
+void compare(const reduced_grid<Format>& G, F f, double floor, double* abs_err,
+  double* rel_err)
+{
+  double max_abs = 0., max_rel = 0.;
+
+  #pragma omp parallel reduction(max:max_abs, max_rel)
+  {
+    double x[BLOCK];
+
+    #pragma omp for schedule(static)
+    for (long i = 0; i < G.N_x; i++)
+    {
+      for (long j0 = 0; j0 < G.N_y; j0 += BLOCK)
+      {
+        long n = G.N_y - j0 < BLOCK ? G.N_y - j0 : BLOCK;
+        G.load(i * G.N_y + j0, x, n);
+        for (long j = 0; j < n; j++)
+        {
+          double exact = f(i, j0 + j);
+          double e = fabs(x[j] - exact);
+          if (e > max_abs) max_abs = e;
+          if (fabs(exact) >= floor && e / fabs(exact) > max_rel)
+            max_rel = e / fabs(exact);
+        }
+      }
+    }
+  }
+  *abs_err = max_abs;
+  *rel_err = max_rel;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+#define AMPLITUDE 100.
+#define SWEEP_A 0.5
+#define SWEEP_B 1.
+
+// a smooth field between -AMPLITUDE and AMPLITUDE
+static double field(long i, long j)
+{
+  return AMPLITUDE * sin(0.001 * i) * cos(0.0007 * j + 0.3);
+}
+
+static double swept_field(long i, long j)
+{
+  return SWEEP_A * field(i, j) + SWEEP_B;
+}
+
+static void print_bound(double b)
+{
+  if (isinf(b)) printf(" %10s", "-"); else printf(" %10.2e", b);
+}
+
+template <class Format>
+int run(long N, const Format& format, double t_double)
+{
+  reduced_grid<Format> A(N, N, format);
+  reduced_grid<Format> B(N, N, format);
+  double abs_a, rel_a, abs_b, rel_b, t = 1e30;
+
+  fill(A, field);
+  fill(B, field); // touches B, so that the sweeps do not measure page faults
+
+  for (int r = 0; r < NUM_REPEATS; r++)
+  {
+    double t0 = omp_get_wtime();
+    sweep(A, B, SWEEP_A, SWEEP_B);
+    double t1 = omp_get_wtime() - t0;
+    if (t1 < t) t = t1;
+  }
+
+  // the errors of storing A, and of the sweep (which rounds on load and store)
+  compare(A, field, 1., &abs_a, &rel_a);
+  compare(B, swept_field, 1., &abs_b, &rel_b);
+
+  printf("%-8s %5zu", format.name(), sizeof(typename Format::storage));
+  print_bound(format.relative_bound());
+  print_bound(format.absolute_bound());
+  printf(" %10.2e %10.2e %10.2e %10.2e %9.4f %8.2f %7.2f\n", rel_a, abs_a,
+    rel_b, abs_b, 1e3 * t, 2. * A.bytes() / t * 1e-9,
+    t_double > 0. ? t_double / t : 1.);
+
+  // the stored A has to be within the bound of the format: the relative one
+  // for the floating point formats, the absolute one for fixed point
+  double tolerance = 1. + 1e-12;
+  bool within = isinf(format.relative_bound())
+    ? abs_a <= format.absolute_bound() * tolerance
+    : rel_a <= format.relative_bound() * tolerance;
+  if (!within) printf("  %s: error larger than its bound\n", format.name());
+
+  return !within;
+}
+
+// the double run, whose time the other formats are compared to
+double time_double(long N)
+{
+  reduced_grid<format_double> A(N, N, format_double());
+  reduced_grid<format_double> B(N, N, format_double());
+  double t = 1e30;
+
+  fill(A, field);
+  fill(B, field);
+  for (int r = 0; r < NUM_REPEATS; r++)
+  {
+    double t0 = omp_get_wtime();
+    sweep(A, B, SWEEP_A, SWEEP_B);
+    double t1 = omp_get_wtime() - t0;
+    if (t1 < t) t = t1;
+  }
+  return t;
+}
+
+int main(int argc, char** argv)
+{
+  long N = argc > 1 ? atol(argv[1]) : 4096;
+  int errors = 0;
+
+  // fixed point scales that just cover the range of the field
+  double range = AMPLITUDE;
+  format_fixed<int16_t> fixed16(range / 32767. * 1.01);
+  format_fixed<int32_t> fixed32(range / 2147483647. * 1.01);
+
+  printf("%ld x %ld grid, field in [-%g, %g], %d threads\n", N, N, AMPLITUDE,
+    AMPLITUDE, omp_get_max_threads());
+  printf("relative errors over |x| >= 1, sweep B = %g A + %g, best of %d\n",
+    SWEEP_A, SWEEP_B, NUM_REPEATS);
+  printf("%-8s %5s %10s %10s %10s %10s %10s %10s %9s %8s %7s\n", "format",
+    "bytes", "rel bound", "abs bound", "rel err A", "abs err A", "rel err B",
+    "abs err B", "sweep ms", "GB/s", "speedup");
+
+  double t_double = time_double(N);
+  errors += run(N, format_double(), t_double);
+  errors += run(N, format_float(), t_double);
+  errors += run(N, format_bf16(), t_double);
+  errors += run(N, format_fp16(), t_double);
+  errors += run(N, fixed16, t_double);
+  errors += run(N, fixed32, t_double);
+
+  return errors != 0;
+}
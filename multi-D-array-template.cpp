@@ -0,0 +1,343 @@
+////////////////////////////////////////////////////////////////////////////////
+// contiguous multi-D arrays without a row-pointer table
+//
+// compile with g++ -fopenacc -fopenmp -O2 -Wall multi-D-array-template.cpp
+// (OpenACC runs on the host with GCC) or nvc++ -acc=gpu -mp -O2
+//
+// openacc-multi-D-array.c and openacc-multi-D-array-pointer.c allocate a 2D
+// array as one contiguous block of data plus a table of pointers to the start
+// of each row. That keeps the A[i][j] syntax, but every access first has to
+// load A[i] from the table before it can load A[i][j]. The compiler cannot
+// prove that the row pointers are evenly spaced (or even that B's rows do not
+// overlap A's), which keeps it from vectorizing the copyAB loop.
+//
+// This snippet replaces the table by a templated N-dimensional array type
+//
+//   nd_array<T, E0, E1, ...>
+//
+// holding a single aligned block. Each extent Ek is either a compile-time
+// constant or DYNAMIC_EXTENT, in which case it is given to the constructor.
+// An element is addressed with A(i, j), which for two dimensions computes
+// i * ld + j: a single multiply-add, with ld the (possibly padded) length of
+// a row. Only the dynamic extents are stored in the array; the static ones
+// (and ld, when the last extent is static) are constants in the index. Padding rounds every row up to a whole number of cache lines and,
+// if requested, adds one more cache line whenever a row would be a multiple of
+// 4 KiB long, so that walking down a column does not keep hitting the same
+// cache set.
+//
+// The class is move-only and frees its block in its destructor. For the
+// OpenACC and OpenMP loops, data() and ld() give the raw pointer and row
+// length, and C code can use the array through the extern "C" wrappers
+// (nd2_double_*) declared at the end.
+//
+// main() checks copyAB for both array types and then benchmarks the pointer
+// table version against nd_array for RES = 10 ... 8192.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <array>
+#include <utility>
+#include <omp.h>
+
+#define DYNAMIC_EXTENT 0
+#define ND_ALIGNMENT 64
+#define ND_ALIAS_STRIDE 4096
+
+template <class T, long... Extents>
+class nd_array
+{
+  public:
+
+    static const int rank = sizeof...(Extents);
+    static const int num_dynamic = ((Extents == DYNAMIC_EXTENT) + ... + 0);
+    static constexpr long static_ext[rank] = { Extents... };
+
+    // the dynamic extents, in order. pad_rows adds the anti-aliasing padding
+    // (rows are always rounded up to whole cache lines).
+    explicit nd_array(const std::array<long, num_dynamic>& dynamic_extents =
+      std::array<long, num_dynamic>(), bool pad_rows = false)
+    {
+      for (int d = 0; d < num_dynamic; d++) ext[d] = dynamic_extents[d];
+
+      row = round_row(extent(rank - 1));
+      if (pad_rows && (row * (long) sizeof(T)) % ND_ALIAS_STRIDE == 0)
+        row += per_line;
+
+      n_alloc = row;
+      for (int k = 0; k < rank - 1; k++) n_alloc *= extent(k);
+
+      void* p = NULL;
+      if (posix_memalign(&p, ND_ALIGNMENT, n_alloc * sizeof(T)) != 0)
+      {
+        printf("nd_array: could not allocate %li elements\n", n_alloc);
+        exit(1);
+      }
+      buffer = (T*) p;
+    }
+
+    ~nd_array() { free(buffer); }
+
+    nd_array(const nd_array&) = delete;
+    nd_array& operator=(const nd_array&) = delete;
+    nd_array(nd_array&& other) noexcept { take(other); }
+    nd_array& operator=(nd_array&& other) noexcept
+    {
+      if (this != &other) { free(buffer); take(other); }
+      return *this;
+    }
+
+    // element access. The loop over k is unrolled by the compiler, leaving
+    // one multiply-add per dimension after the first, with the static extents
+    // (and a static ld) folded into it as constants.
+    template <class... Ints>
+    inline T& operator()(Ints... idx) const
+    {
+      static_assert(sizeof...(Ints) == rank, "wrong number of indices");
+      const long i[rank] = { (long) idx... };
+      long offset = i[0];
+      for (int k = 1; k < rank - 1; k++) offset = offset * extent(k) + i[k];
+      if (rank > 1) offset = offset * ld() + i[rank - 1];
+      return buffer[offset];
+    }
+
+    inline long extent(int k) const
+    {
+      return static_ext[k] != DYNAMIC_EXTENT ? static_ext[k]
+        : ext[dynamic_index(k)];
+    }
+    // the padded length of the last dimension
+    inline long ld() const { return static_row ? static_row : row; }
+    long size() const { return n_alloc; } // including padding
+    T* data() const { return buffer; }
+
+  protected:
+
+    static const long per_line = ND_ALIGNMENT / sizeof(T);
+
+    T* buffer;
+    long ext[num_dynamic > 0 ? num_dynamic : 1]; // the dynamic extents only
+    long row;
+    long n_alloc;
+
+    // rows are rounded up to whole cache lines
+    static constexpr long round_row(long n)
+    {
+      return ((n + per_line - 1) / per_line) * per_line;
+    }
+
+    // the row length when it is known at compile time, 0 otherwise. It is not
+    // if the last extent is dynamic, nor if the rounded row is a multiple of
+    // ND_ALIAS_STRIDE, since then it depends on pad_rows.
+    static constexpr long static_row =
+      static_ext[rank - 1] != DYNAMIC_EXTENT
+      && (round_row(static_ext[rank - 1]) * (long) sizeof(T))
+        % ND_ALIAS_STRIDE != 0 ? round_row(static_ext[rank - 1]) : 0;
+
+    // the position of dimension k among the dynamic extents
+    static constexpr int dynamic_index(int k)
+    {
+      int d = 0;
+      for (int l = 0; l < k; l++) d += static_ext[l] == DYNAMIC_EXTENT;
+      return d;
+    }
+
+    void take(nd_array& other)
+    {
+      buffer = other.buffer;
+      row = other.row;
+      n_alloc = other.n_alloc;
+      for (int d = 0; d < num_dynamic; d++) ext[d] = other.ext[d];
+      other.buffer = NULL;
+      other.n_alloc = 0;
+    }
+};
+
+typedef nd_array<double, DYNAMIC_EXTENT, DYNAMIC_EXTENT> array_2D_double;
+
+////////////////////////////////////////////////////////////////////////////////
+// C-callable wrappers for the 2D double case. A C file declares
+//
+//   typedef struct nd2_double nd2_double;
+//   nd2_double* nd2_double_create(long N_x, long N_y, int pad_rows);
+//   double* nd2_double_data(const nd2_double* A);
+//   long nd2_double_ld(const nd2_double* A);
+//   void nd2_double_free(nd2_double* A);
+//
+// and accesses element (i, j) as nd2_double_data(A)[i * nd2_double_ld(A) + j].
+
+struct nd2_double
+{
+  array_2D_double a;
+};
+
+extern "C" nd2_double* nd2_double_create(long N_x, long N_y, int pad_rows)
+{
+  return new nd2_double { array_2D_double({ N_x, N_y }, pad_rows != 0) };
+}
+
+extern "C" double* nd2_double_data(const nd2_double* A) { return A->a.data(); }
+extern "C" long nd2_double_ld(const nd2_double* A) { return A->a.ld(); }
+extern "C" void nd2_double_free(nd2_double* A) { delete A; }
+
+////////////////////////////////////////////////////////////////////////////////
+// the pointer-table version, from openacc-multi-D-array.c
+
+double** allocate_2D_array_double(const int N_x, const int N_y)
+{
+  double **A;
+  int i_x;
+
+  A = (double**) malloc(N_x * sizeof(double*));
+  A[0] = (double*) malloc((size_t) N_x * N_y * sizeof(double));
+  for (i_x = 0; i_x < N_x; i_x++)
+  {
+    A[i_x] = A[0] + (size_t) i_x * N_y;
+  }
+
+  return A;
+}
+
+void free_2D_array_double(double **A)
+{
+  free(A[0]);
+  free(A);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void copyAB_table(double** A, double** B, int res)
+{
+  int i, j;
+
+  #pragma omp parallel for private(j) schedule(static)
+  for (i = 0; i < res; i++)
+    for (j = 0; j < res; j++)
+      B[i][j] = A[i][j];
+}
+
+void copyAB_nd(const array_2D_double& A, array_2D_double& B, int res)
+{
+  int i, j;
+
+  #pragma omp parallel for private(j) schedule(static)
+  for (i = 0; i < res; i++)
+    for (j = 0; j < res; j++)
+      B(i, j) = A(i, j);
+}
+
+// the OpenACC version works on the raw blocks, which is what gets copied to
+// the device. A and B may be padded differently, so each keeps its own ld and
+// size. With ld a loop invariant, the index is again a multiply-add.
+void copyAB_acc(const array_2D_double& A, array_2D_double& B, int res)
+{
+  double* a = A.data();
+  double* b = B.data();
+  long ld_a = A.ld(), ld_b = B.ld();
+  long n_a = A.size(), n_b = B.size();
+  int i, j;
+
+  #pragma acc parallel loop collapse(2) copyin(a[0:n_a]) copyout(b[0:n_b])
+  for (i = 0; i < res; i++)
+    for (j = 0; j < res; j++)
+      b[i * ld_b + j] = a[i * ld_a + j];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int main()
+{
+  const int sizes[] = { 10, 100, 1000, 2000, 4096, 8192 };
+  const int num_sizes = sizeof(sizes) / sizeof(sizes[0]);
+  int i, j, s, r, res, reps;
+  double t0, t_table, t_nd, t_nd_pad;
+
+  // first make sure every version copies correctly
+  res = 10;
+  array_2D_double A({ res, res }, true);
+  array_2D_double B({ res, res }, true);
+  array_2D_double C({ res, 3 * res }, false); // wider rows than A: another ld
+  for (i = 0; i < res; i++)
+    for (j = 0; j < res; j++)
+      A(i, j) = (double) (i * res + j);
+
+  copyAB_nd(A, B, res);
+  copyAB_acc(A, C, res);
+  for (i = 0; i < res; i++)
+    for (j = 0; j < res; j++)
+      if (B(i, j) != i * res + j || C(i, j) != i * res + j)
+      {
+        printf("wrong copy at (%d, %d): %lf %lf\n", i, j, B(i, j), C(i, j));
+        return 1;
+      }
+  printf("copyAB_nd and copyAB_acc agree\n");
+
+  // a mix of static and dynamic extents: 3 x res x 5, rows of 8 doubles
+  nd_array<double, 3, DYNAMIC_EXTENT, 5> S({ res });
+  for (i = 0; i < 3; i++)
+    for (j = 0; j < res; j++)
+      for (int k = 0; k < 5; k++) S(i, j, k) = i * 100 + j * 10 + k;
+  if (S.ld() != 8 || S.size() != 3 * res * 8 || S.data()[(2 * res + 7) * 8 + 4]
+    != 274.)
+  {
+    printf("wrong layout with static extents\n");
+    return 1;
+  }
+
+  // the same array through the C wrappers
+  nd2_double* W = nd2_double_create(res, res, 1);
+  nd2_double_data(W)[3 * nd2_double_ld(W) + 4] = 42.;
+  printf("through the C wrappers: ld = %li, (3, 4) = %lf\n",
+    nd2_double_ld(W), nd2_double_data(W)[3 * nd2_double_ld(W) + 4]);
+  nd2_double_free(W);
+
+  printf("\nthreads: %i\n", omp_get_max_threads());
+  printf("%6s %6s %14s %14s %14s\n", "RES", "reps", "table GB/s",
+    "nd GB/s", "nd pad GB/s");
+
+  for (s = 0; s < num_sizes; s++)
+  {
+    res = sizes[s];
+    // aim for roughly the same amount of copying at every size
+    reps = (int) (200000000L / ((long) res * res));
+    if (reps < 3) reps = 3;
+
+    double** At = allocate_2D_array_double(res, res);
+    double** Bt = allocate_2D_array_double(res, res);
+    array_2D_double An({ res, res }, false);
+    array_2D_double Bn({ res, res }, false);
+    array_2D_double Ap({ res, res }, true);
+    array_2D_double Bp({ res, res }, true);
+
+    #pragma omp parallel for private(j) schedule(static)
+    for (i = 0; i < res; i++)
+      for (j = 0; j < res; j++)
+      {
+        At[i][j] = Bt[i][j] = An(i, j) = Bn(i, j) = Ap(i, j) = Bp(i, j) = i + j;
+      }
+
+    t0 = omp_get_wtime();
+    for (r = 0; r < reps; r++) copyAB_table(At, Bt, res);
+    t_table = (omp_get_wtime() - t0) / reps;
+
+    t0 = omp_get_wtime();
+    for (r = 0; r < reps; r++) copyAB_nd(An, Bn, res);
+    t_nd = (omp_get_wtime() - t0) / reps;
+
+    t0 = omp_get_wtime();
+    for (r = 0; r < reps; r++) copyAB_nd(Ap, Bp, res);
+    t_nd_pad = (omp_get_wtime() - t0) / reps;
+
+    // one read and one write of every element
+    double bytes = 2. * res * res * sizeof(double);
+    printf("%6d %6d %14.2f %14.2f %14.2f\n", res, reps,
+      bytes / t_table * 1e-9, bytes / t_nd * 1e-9, bytes / t_nd_pad * 1e-9);
+    fflush(stdout);
+
+    free_2D_array_double(At);
+    free_2D_array_double(Bt);
+  }
+
+  return 0;
+}
@@ -0,0 +1,348 @@
+// an OMPT tool that profiles parallel regions
+//
+// How much of the time in a '#pragma omp parallel for' like the ones in
+// class-static-member-openMP.cpp and class-shared-array-openMP.cpp goes to
+// useful work, and how much to starting and stopping the threads and to
+// waiting at the barrier at the end? This tool uses the OpenMP tools
+// interface (OMPT), through which the OpenMP runtime reports events to a
+// library loaded along with the program, to record for every parallel region
+//
+//   - the wall time, from the start of the region to its end
+//   - per thread, the time spent in its implicit task (its share of the
+//     region), split into busy time and time waiting at barriers
+//   - the number of implicit tasks (threads) that took part
+//
+// At the end of the program it prints a table with one line per parallel
+// region in the source (identified by its return address), with the number
+// of times it ran, the mean wall time, the mean fork/join overhead (wall time
+// minus the busy time of the busiest thread), the barrier wait and the load
+// imbalance (how much longer the busiest thread worked than the average one).
+// It also writes all regions, implicit tasks and barrier waits as a trace in
+// the Chrome trace event format, which can be opened in chrome://tracing or
+// https://ui.perfetto.dev.
+//
+// OMPT is supported by the LLVM OpenMP runtime (libomp, as used by clang and
+// the Intel and AMD compilers), but not by GCC's libgomp. Build the tool and
+// the program to profile with clang:
+//
+//   clang++ -fopenmp -fPIC -shared -O2 -Wall -o libompt-region-profiler.so
+//     ompt-region-profiler.cpp
+//   clang++ -fopenmp -O2 class-static-member-openMP.cpp
+//   OMP_TOOL_LIBRARIES=./libompt-region-profiler.so ./a.out
+//
+// The trace is written to ompt-trace.json, or to the file named by the
+// environment variable OMPT_TRACE_FILE.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <atomic>
+#include <omp-tools.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// what gets recorded
+
+// per thread of a region
+typedef struct thread_slot
+{
+  double t_begin; // implicit task begin
+  double t_end;   // implicit task end
+  double wait;    // time spent waiting at barriers in this implicit task
+} thread_slot;
+
+// per parallel region instance
+typedef struct region_record
+{
+  const void* codeptr;
+  double t_begin;
+  double t_end;
+  unsigned int requested;
+  std::atomic<unsigned int> implicit_tasks;
+  std::vector<thread_slot> slots; // indexed by thread number in the team
+} region_record;
+
+// per implicit task, hung onto the task's ompt_data_t
+typedef struct task_record
+{
+  region_record* region;
+  unsigned int index;
+  double t_wait_begin;
+} task_record;
+
+// one entry of the trace, a Chrome trace 'complete' event
+typedef struct trace_event
+{
+  const char* name;
+  int tid;
+  double t_begin;
+  double t_end;
+} trace_event;
+
+// per OS thread. Every thread appends to its own buffer, so that recording
+// events takes no locks. The buffers are registered once, under a lock.
+typedef struct thread_buffer
+{
+  int tid;
+  std::vector<trace_event> events;
+} thread_buffer;
+
+static std::mutex tool_mutex;
+static std::vector<region_record*> regions;
+static std::vector<thread_buffer*> buffers;
+static std::atomic<int> next_tid(0);
+static double t_start;
+
+static thread_local thread_buffer* my_buffer = NULL;
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static thread_buffer* get_buffer()
+{
+  if (my_buffer == NULL)
+  {
+    my_buffer = new thread_buffer;
+    my_buffer->tid = next_tid++;
+    std::lock_guard<std::mutex> lock(tool_mutex);
+    buffers.push_back(my_buffer);
+  }
+  return my_buffer;
+}
+
+static void record_event(const char* name, double t_begin, double t_end)
+{
+  thread_buffer* b = get_buffer();
+  trace_event e = { name, b->tid, t_begin, t_end };
+  b->events.push_back(e);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// the callbacks
+
+static void on_parallel_begin(ompt_data_t* encountering_task_data,
+  const ompt_frame_t* encountering_task_frame, ompt_data_t* parallel_data,
+  unsigned int requested_parallelism, int flags, const void* codeptr_ra)
+{
+  region_record* r = new region_record;
+
+  r->codeptr = codeptr_ra;
+  r->t_begin = now();
+  r->t_end = r->t_begin;
+  r->requested = requested_parallelism;
+  r->implicit_tasks = 0;
+  // the team can not be larger than requested, so every thread has its slot
+  // without the vector ever having to grow while the team is running
+  thread_slot empty = { 0., 0., 0. };
+  r->slots.assign(requested_parallelism, empty);
+  parallel_data->ptr = r;
+
+  std::lock_guard<std::mutex> lock(tool_mutex);
+  regions.push_back(r);
+}
+
+static void on_parallel_end(ompt_data_t* parallel_data,
+  ompt_data_t* encountering_task_data, int flags, const void* codeptr_ra)
+{
+  region_record* r = (region_record*) parallel_data->ptr;
+
+  r->t_end = now();
+  record_event("parallel region", r->t_begin, r->t_end);
+}
+
+static void on_implicit_task(ompt_scope_endpoint_t endpoint,
+  ompt_data_t* parallel_data, ompt_data_t* task_data,
+  unsigned int actual_parallelism, unsigned int index, int flags)
+{
+  // the implicit task of the initial thread is the whole program
+  if (flags & ompt_task_initial) return;
+
+  if (endpoint == ompt_scope_begin)
+  {
+    task_record* t = new task_record;
+    t->region = (region_record*) parallel_data->ptr;
+    t->index = index;
+    t->t_wait_begin = 0.;
+    task_data->ptr = t;
+
+    if (index < t->region->slots.size())
+    {
+      t->region->slots[index].t_begin = now();
+      t->region->slots[index].wait = 0.;
+    }
+    t->region->implicit_tasks++;
+  }
+  else if (endpoint == ompt_scope_end)
+  {
+    // parallel_data may be NULL here, which is why the task keeps a pointer
+    // to its region itself
+    task_record* t = (task_record*) task_data->ptr;
+    if (t == NULL) return;
+
+    if (t->index < t->region->slots.size())
+    {
+      thread_slot* s = &t->region->slots[t->index];
+      s->t_end = now();
+      record_event("implicit task", s->t_begin, s->t_end);
+    }
+    delete t;
+    task_data->ptr = NULL;
+  }
+}
+
+static void on_sync_region_wait(ompt_sync_region_t kind,
+  ompt_scope_endpoint_t endpoint, ompt_data_t* parallel_data,
+  ompt_data_t* task_data, const void* codeptr_ra)
+{
+  task_record* t = task_data != NULL ? (task_record*) task_data->ptr : NULL;
+  if (t == NULL) return;
+
+  if (endpoint == ompt_scope_begin)
+  {
+    t->t_wait_begin = now();
+  }
+  else if (endpoint == ompt_scope_end)
+  {
+    double t_end = now();
+    if (t->index < t->region->slots.size())
+      t->region->slots[t->index].wait += t_end - t->t_wait_begin;
+    record_event("barrier wait", t->t_wait_begin, t_end);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// the report
+
+typedef struct site_summary
+{
+  long count;
+  double wall;
+  double overhead;
+  double wait;
+  double imbalance;
+  unsigned int max_threads;
+} site_summary;
+
+static void print_summary()
+{
+  std::map<const void*, site_summary> sites;
+
+  for (size_t k = 0; k < regions.size(); k++)
+  {
+    region_record* r = regions[k];
+    unsigned int n = r->implicit_tasks;
+    double wall = r->t_end - r->t_begin;
+    double busy_max = 0., busy_sum = 0., wait_sum = 0.;
+
+    if (n > r->slots.size()) n = r->slots.size();
+    for (unsigned int i = 0; i < n; i++)
+    {
+      const thread_slot* s = &r->slots[i];
+      double busy = (s->t_end - s->t_begin) - s->wait;
+      if (busy > busy_max) busy_max = busy;
+      busy_sum += busy;
+      wait_sum += s->wait;
+    }
+
+    site_summary* site = &sites[r->codeptr];
+    site->count++;
+    site->wall += wall;
+    site->overhead += wall - busy_max;
+    site->wait += n > 0 ? wait_sum / n : 0.;
+    site->imbalance += (n > 0 && busy_max > 0.)
+      ? (busy_max - busy_sum / n) / busy_max : 0.;
+    if (n > site->max_threads) site->max_threads = n;
+  }
+
+  fprintf(stderr, "\nOMPT parallel region profile (times are means per "
+    "region instance)\n");
+  fprintf(stderr, "%-18s %8s %8s %12s %12s %12s %10s\n", "site", "count",
+    "threads", "wall (us)", "fork/join", "barrier", "imbalance");
+
+  std::map<const void*, site_summary>::iterator it;
+  for (it = sites.begin(); it != sites.end(); ++it)
+  {
+    const site_summary* s = &it->second;
+    fprintf(stderr, "%-18p %8ld %8u %12.2f %12.2f %12.2f %9.1f%%\n",
+      it->first, s->count, s->max_threads, 1e6 * s->wall / s->count,
+      1e6 * s->overhead / s->count, 1e6 * s->wait / s->count,
+      100. * s->imbalance / s->count);
+  }
+  fprintf(stderr, "(resolve the sites with addr2line -e <program> <site>)\n");
+}
+
+static void write_trace()
+{
+  const char* filename = getenv("OMPT_TRACE_FILE");
+  if (filename == NULL) filename = "ompt-trace.json";
+
+  FILE* f = fopen(filename, "w");
+  if (f == NULL) { perror(filename); return; }
+
+  fprintf(f, "{\"traceEvents\": [\n");
+  bool first = true;
+  for (size_t b = 0; b < buffers.size(); b++)
+  {
+    const std::vector<trace_event>& events = buffers[b]->events;
+    for (size_t k = 0; k < events.size(); k++)
+    {
+      const trace_event* e = &events[k];
+      fprintf(f, "%s  {\"name\": \"%s\", \"ph\": \"X\", \"pid\": 0, "
+        "\"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}", first ? "" : ",\n",
+        e->name, e->tid, 1e6 * (e->t_begin - t_start),
+        1e6 * (e->t_end - e->t_begin));
+      first = false;
+    }
+  }
+  fprintf(f, "\n], \"displayTimeUnit\": \"ns\"}\n");
+  fclose(f);
+
+  fprintf(stderr, "trace written to %s\n", filename);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// the entry points the runtime looks for
+
+static int tool_initialize(ompt_function_lookup_t lookup,
+  int initial_device_num, ompt_data_t* tool_data)
+{
+  ompt_set_callback_t set_callback =
+    (ompt_set_callback_t) lookup("ompt_set_callback");
+  if (set_callback == NULL) return 0; // returning 0 deactivates the tool
+
+  t_start = now();
+
+  set_callback(ompt_callback_parallel_begin,
+    (ompt_callback_t) on_parallel_begin);
+  set_callback(ompt_callback_parallel_end, (ompt_callback_t) on_parallel_end);
+  set_callback(ompt_callback_implicit_task,
+    (ompt_callback_t) on_implicit_task);
+  if (set_callback(ompt_callback_sync_region_wait,
+    (ompt_callback_t) on_sync_region_wait) == ompt_set_never)
+    fprintf(stderr, "OMPT: no barrier wait events, barrier times will be 0\n");
+
+  return 1;
+}
+
+static void tool_finalize(ompt_data_t* tool_data)
+{
+  print_summary();
+  write_trace();
+}
+
+extern "C" ompt_start_tool_result_t* ompt_start_tool(unsigned int omp_version,
+  const char* runtime_version)
+{
+  static ompt_start_tool_result_t result = { tool_initialize, tool_finalize,
+    { 0 } };
+
+  fprintf(stderr, "OMPT region profiler loaded by %s\n", runtime_version);
+  return &result;
+}
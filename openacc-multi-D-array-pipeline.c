@@ -0,0 +1,307 @@
+////////////////////////////////////////////////////////////////////////////////
+// overlapping transfers and compute for a grid, in row blocks
+//
+// compile with gcc -fopenacc -fopenmp -O2 -Wall openacc-multi-D-array-pipeline.c
+// (OpenACC runs on the host with GCC) or pgcc -acc=gpu -mp
+// run with ./a.out [acc|host] [N_x] [N_y] [block_rows] [depth]
+//
+// openacc-multi-D-array.c copies all of A to the device, computes B, and
+// copies all of B back, one step after the other. While data moves, the
+// device sits idle, and while it computes, the bus sits idle.
+//
+// Here the grid is cut into blocks of rows, and every block goes through
+// three stages: transfer in (A), compute (B from A), transfer out (B). The
+// stages of one block run in order, but different blocks are in different
+// stages at the same time, with up to 'depth' blocks in flight. Two backends
+// implement the same pipeline:
+//
+//   acc   every block in flight gets its own async queue (1 ... depth), and
+//         the three stages of a block are issued on that queue as update
+//         device, parallel loop and update self of the block's rows. Blocks
+//         on different queues can overlap. Block b + depth reuses the queue
+//         of block b, which orders it after block b.
+//   host  OpenMP tasks. The 'device' is a set of depth staging buffers on the
+//         host, transfers are memcpy into and out of them, and the depend
+//         clauses make sure a staging buffer is not overwritten before the
+//         block in it has been computed and copied out. This lets us check
+//         the pipeline logic without a GPU.
+//
+// To report how well the stages overlap, the same blocks are first run with
+// every stage waited on before the next starts, which gives the time spent in
+// each stage. Then the pipelined run gives the wall time. For every stage we
+// report the fraction of the pipelined wall time it kept busy, and overall
+//
+//   overlap efficiency = (T_serial - T_pipelined) / (T_serial - T_longest)
+//
+// where T_longest is the total time of the slowest stage: 1 means the other
+// stages are completely hidden behind the slowest one, 0 means no overlap.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <omp.h>
+
+#define MAX_DEPTH 3
+#define NUM_STAGES 3
+
+const char* stage_names[NUM_STAGES] = { "transfer in", "compute",
+  "transfer out" };
+
+typedef struct pipeline
+{
+  double* A; // input grid, N_x by N_y, on the host
+  double* B; // output grid
+  long N_x;
+  long N_y;
+  long block_rows;
+  long num_blocks;
+  int depth;
+
+  // host backend only: the staging buffers that play the role of the device
+  double* slot_in[MAX_DEPTH];
+  double* slot_out[MAX_DEPTH];
+} pipeline;
+
+// the work done per element, enough arithmetic to not be purely a copy
+#pragma acc routine seq
+static inline double kernel(double a)
+{
+  return 0.5 * a * a + 2. * a + 1.;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void block_range(const pipeline* p, long b, long* start, long* count)
+{
+  long first = b * p->block_rows;
+  long rows = first + p->block_rows <= p->N_x ? p->block_rows : p->N_x - first;
+
+  *start = first * p->N_y;
+  *count = rows * p->N_y;
+}
+
+// the host backend stages, for block b in staging slot s
+static void host_in(pipeline* p, long b, int s)
+{
+  long start, count;
+  block_range(p, b, &start, &count);
+  memcpy(p->slot_in[s], p->A + start, count * sizeof(double));
+}
+
+static void host_compute(pipeline* p, long b, int s)
+{
+  long start, count, k;
+  double* in = p->slot_in[s];
+  double* out = p->slot_out[s];
+
+  block_range(p, b, &start, &count);
+  #pragma omp simd
+  for (k = 0; k < count; k++) out[k] = kernel(in[k]);
+}
+
+static void host_out(pipeline* p, long b, int s)
+{
+  long start, count;
+  block_range(p, b, &start, &count);
+  memcpy(p->B + start, p->slot_out[s], count * sizeof(double));
+}
+
+// the OpenACC backend stages, for block b on async queue q
+static void acc_in(pipeline* p, long b, int q)
+{
+  long start, count;
+  block_range(p, b, &start, &count);
+  #pragma acc update device(p->A[start:count]) async(q)
+}
+
+static void acc_compute(pipeline* p, long b, int q)
+{
+  long start, count, k;
+  double* A = p->A;
+  double* B = p->B;
+
+  block_range(p, b, &start, &count);
+  #pragma acc parallel loop present(A[start:count], B[start:count]) async(q)
+  for (k = start; k < start + count; k++) B[k] = kernel(A[k]);
+}
+
+static void acc_out(pipeline* p, long b, int q)
+{
+  long start, count;
+  block_range(p, b, &start, &count);
+  #pragma acc update self(p->B[start:count]) async(q)
+}
+
+static void wait_queue(int q)
+{
+  #pragma acc wait(q)
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// every stage of every block waited for before the next one starts. The time
+// per stage is added to t_stage.
+void run_serial(pipeline* p, int use_acc, double* t_stage)
+{
+  long b;
+  double t0;
+
+  for (b = 0; b < p->num_blocks; b++)
+  {
+    t0 = omp_get_wtime();
+    if (use_acc) { acc_in(p, b, 1); wait_queue(1); } else host_in(p, b, 0);
+    t_stage[0] += omp_get_wtime() - t0;
+
+    t0 = omp_get_wtime();
+    if (use_acc) { acc_compute(p, b, 1); wait_queue(1); }
+    else host_compute(p, b, 0);
+    t_stage[1] += omp_get_wtime() - t0;
+
+    t0 = omp_get_wtime();
+    if (use_acc) { acc_out(p, b, 1); wait_queue(1); } else host_out(p, b, 0);
+    t_stage[2] += omp_get_wtime() - t0;
+  }
+}
+
+void run_pipelined_acc(pipeline* p)
+{
+  long b;
+
+  for (b = 0; b < p->num_blocks; b++)
+  {
+    int q = 1 + (int) (b % p->depth);
+    acc_in(p, b, q);
+    acc_compute(p, b, q);
+    acc_out(p, b, q);
+  }
+  #pragma acc wait
+}
+
+void run_pipelined_host(pipeline* p)
+{
+  long b;
+
+  #pragma omp parallel
+  #pragma omp single
+  {
+    for (b = 0; b < p->num_blocks; b++)
+    {
+      int s = (int) (b % p->depth);
+
+      // the first entry of each staging buffer stands for the whole buffer in
+      // the depend clauses. The transfer in waits for the compute of block
+      // b - depth, which read slot_in[s].
+      #pragma omp task firstprivate(b, s) depend(out: p->slot_in[s][0])
+      host_in(p, b, s);
+
+      // waits for the transfer out of block b - depth from slot_out[s]
+      #pragma omp task firstprivate(b, s) depend(in: p->slot_in[s][0]) \
+        depend(out: p->slot_out[s][0])
+      host_compute(p, b, s);
+
+      #pragma omp task firstprivate(b, s) depend(in: p->slot_out[s][0])
+      host_out(p, b, s);
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char** argv)
+{
+  pipeline p;
+  int use_acc = 0;
+  int k;
+  long i, n;
+  double t0, t_pipe, t_serial, t_longest;
+  double t_stage[NUM_STAGES] = { 0., 0., 0. };
+
+  if (argc > 1) use_acc = strcmp(argv[1], "acc") == 0;
+  p.N_x = argc > 2 ? atol(argv[2]) : 4096;
+  p.N_y = argc > 3 ? atol(argv[3]) : 4096;
+  p.block_rows = argc > 4 ? atol(argv[4]) : 256;
+  p.depth = argc > 5 ? atoi(argv[5]) : 2;
+  if (p.depth < 1) p.depth = 1;
+  if (p.depth > MAX_DEPTH) p.depth = MAX_DEPTH;
+  p.num_blocks = (p.N_x + p.block_rows - 1) / p.block_rows;
+
+  n = p.N_x * p.N_y;
+  p.A = malloc(n * sizeof(double));
+  p.B = malloc(n * sizeof(double));
+  for (i = 0; i < n; i++) p.A[i] = (double) (i % 1000);
+
+  if (use_acc)
+  {
+    #pragma acc enter data create(p.A[0:n], p.B[0:n])
+  }
+  else
+  {
+    for (k = 0; k < p.depth; k++)
+    {
+      p.slot_in[k] = malloc(p.block_rows * p.N_y * sizeof(double));
+      p.slot_out[k] = malloc(p.block_rows * p.N_y * sizeof(double));
+    }
+  }
+
+  printf("backend: %s, grid %li x %li, %li blocks of %li rows, depth %d\n",
+    use_acc ? "acc" : "host", p.N_x, p.N_y, p.num_blocks, p.block_rows,
+    p.depth);
+
+  // warm up (page faults, device allocation), then the serial reference run
+  if (use_acc) run_pipelined_acc(&p); else run_pipelined_host(&p);
+  run_serial(&p, use_acc, t_stage);
+
+  memset(p.B, 0, n * sizeof(double));
+  t0 = omp_get_wtime();
+  if (use_acc) run_pipelined_acc(&p); else run_pipelined_host(&p);
+  t_pipe = omp_get_wtime() - t0;
+
+  for (i = 0; i < n; i++)
+  {
+    if (p.B[i] != kernel(p.A[i]))
+    {
+      printf("wrong result at %li\n", i);
+      return 1;
+    }
+  }
+
+  t_serial = t_longest = 0.;
+  for (k = 0; k < NUM_STAGES; k++)
+  {
+    t_serial += t_stage[k];
+    if (t_stage[k] > t_longest) t_longest = t_stage[k];
+  }
+
+  printf("%-14s %12s %14s\n", "stage", "time", "busy fraction");
+  for (k = 0; k < NUM_STAGES; k++)
+    printf("%-14s %10.6f s %13.1f%%\n", stage_names[k], t_stage[k],
+      100. * t_stage[k] / t_pipe);
+  printf("serial: %f s, pipelined: %f s", t_serial, t_pipe);
+  // if the slowest stage takes practically all the time (as with the host
+  // fallback of OpenACC, where transfers cost nothing), there is nothing to
+  // hide and the efficiency is meaningless
+  if (t_serial - t_longest > 0.01 * t_serial)
+    printf(", overlap efficiency: %.1f%%\n",
+      100. * (t_serial - t_pipe) / (t_serial - t_longest));
+  else
+    printf(", overlap efficiency: n/a\n");
+
+  if (use_acc)
+  {
+    #pragma acc exit data delete(p.A[0:n], p.B[0:n])
+  }
+  else
+  {
+    for (k = 0; k < p.depth; k++)
+    {
+      free(p.slot_in[k]);
+      free(p.slot_out[k]);
+    }
+  }
+  free(p.A);
+  free(p.B);
+
+  return 0;
+}
@@ -0,0 +1,415 @@
+// testing a registry of data present on the device
+//
+// compile with g++ -fopenacc -Wall openacc-present-table.cpp (runs on the
+// host, which is enough to check the bookkeeping) or pgc++ -acc=gpu
+//
+// In openacc-present-test.cpp, allocate, fill and release each issue their
+// own enter data, update self and exit data for the grid. When such functions
+// get called over and over for the same grids, most of those transfers move
+// data that is already where it needs to be.
+//
+// This snippet adds a small registry, the present table, that sits between
+// the code and the OpenACC runtime. For every host range it has put on the
+// device, it keeps
+//
+//   - a reference count, like the OpenACC runtime itself does
+//   - which copy is current: the host copy, the device copy or both
+//
+// and uses that to skip work:
+//
+//   enter            a range that is already on the device, and whose device
+//                    copy is current, is not copied again
+//   exit             a range whose count drops to zero stays on the device
+//                    (it is only 'retired'), so that entering it again later
+//                    costs nothing. forget(p) or release_all really delete it.
+//   update_device    skipped unless the host copy was marked as modified
+//   update_self      skipped unless the device copy was marked as modified
+//
+// Since the registry cannot see what a kernel or the host code writes to, the
+// code has to tell it, with mark_host_modified and mark_device_modified.
+//
+// Retired ranges are keyed by their host address, so host memory must be
+// forgotten (forget(p)) before it is freed. Otherwise a later allocation at
+// the same address would find the stale entry, which still claims a current
+// device copy. enter also drops retired entries that only partly overlap a
+// new range, and refuses to map over ranges that are still entered.
+//
+// Every transfer that does happen, and every one that gets skipped, is counted
+// in bytes, and print_counters shows the totals.
+//
+// With GCC's host fallback the OpenACC runtime calls do nothing (host and
+// device share the same memory), but the bookkeeping and counters still run,
+// so the logic can be tested without a GPU.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <map>
+#include <openacc.h>
+
+enum present_state
+{
+  PRESENT_BOTH_CURRENT,   // host and device copy are the same
+  PRESENT_HOST_NEWER,     // the host copy was modified since the last update
+  PRESENT_DEVICE_NEWER    // the device copy was modified since the last update
+};
+
+typedef struct present_entry
+{
+  size_t bytes;
+  int refcount; // zero for ranges that are retired but still on the device
+  present_state state;
+} present_entry;
+
+typedef struct present_counters
+{
+  size_t bytes_to_device;
+  size_t bytes_to_host;
+  size_t bytes_skipped;
+  long transfers;
+  long transfers_skipped;
+} present_counters;
+
+class present_table
+{
+  public:
+
+    // the equivalent of 'enter data copyin' (copy = true) or 'create'
+    void enter(void* p, size_t bytes, bool copy);
+    // the equivalent of 'exit data delete', or 'copyout' if copy = true
+    void exit(void* p, bool copy);
+    void update_device(void* p, size_t bytes);
+    void update_self(void* p, size_t bytes);
+
+    void mark_host_modified(void* p);
+    void mark_device_modified(void* p);
+
+    // really remove the retired range containing p from the device. To be
+    // called before the host memory is freed.
+    void forget(void* p);
+    // really remove all retired ranges from the device
+    void release_all();
+
+    void print_counters(const char* label);
+    present_counters counters;
+
+    present_table() { counters = present_counters(); }
+    ~present_table() { release_all(); }
+
+  protected:
+
+    std::map<char*, present_entry> entries; // keyed by the start of the range
+
+    // the entry whose range contains [p, p + bytes), or entries.end()
+    std::map<char*, present_entry>::iterator find(void* p, size_t bytes);
+    void skipped(size_t bytes);
+};
+
+std::map<char*, present_entry>::iterator present_table::find(void* p,
+  size_t bytes)
+{
+  char* c = (char*) p;
+  std::map<char*, present_entry>::iterator it = entries.upper_bound(c);
+
+  if (it == entries.begin()) return entries.end();
+  --it; // the last entry starting at or before c
+  if (c + bytes <= it->first + it->second.bytes) return it;
+
+  return entries.end();
+}
+
+void present_table::skipped(size_t bytes)
+{
+  counters.bytes_skipped += bytes;
+  counters.transfers_skipped++;
+}
+
+void present_table::enter(void* p, size_t bytes, bool copy)
+{
+  std::map<char*, present_entry>::iterator it = find(p, bytes);
+
+  if (it != entries.end())
+  {
+    present_entry* e = &it->second;
+    // already on the device: only copy if asked to and the host is newer
+    if (copy && e->state == PRESENT_HOST_NEWER)
+    {
+      acc_update_device(it->first, e->bytes);
+      counters.bytes_to_device += e->bytes;
+      counters.transfers++;
+      e->state = PRESENT_BOTH_CURRENT;
+    }
+    else if (copy)
+    {
+      skipped(bytes);
+    }
+    e->refcount++;
+    return;
+  }
+
+  // a new range. Whatever overlaps it belongs to memory that was freed and
+  // reused: retired entries are dropped, entered ones are an error.
+  char* c = (char*) p;
+  it = entries.upper_bound(c);
+  if (it != entries.begin())
+  {
+    --it;
+    if (it->first + it->second.bytes <= c) ++it; // ends before c
+  }
+  while (it != entries.end() && it->first < c + bytes)
+  {
+    if (it->second.refcount > 0)
+    {
+      printf("present_table: enter of %p overlaps %p, which is still "
+        "entered\n", p, (void*) it->first);
+      return;
+    }
+    acc_delete(it->first, it->second.bytes);
+    it = entries.erase(it);
+  }
+
+  present_entry e;
+  e.bytes = bytes;
+  e.refcount = 1;
+  if (copy)
+  {
+    acc_copyin(p, bytes);
+    counters.bytes_to_device += bytes;
+    counters.transfers++;
+    e.state = PRESENT_BOTH_CURRENT;
+  }
+  else
+  {
+    acc_create(p, bytes);
+    e.state = PRESENT_HOST_NEWER; // the device copy holds nothing useful yet
+  }
+  entries[(char*) p] = e;
+}
+
+void present_table::exit(void* p, bool copy)
+{
+  std::map<char*, present_entry>::iterator it = find(p, 1);
+  if (it == entries.end() || it->second.refcount == 0)
+  {
+    printf("present_table: exit of %p, which is not present\n", p);
+    return;
+  }
+
+  if (copy) update_self(it->first, it->second.bytes);
+
+  // keep the range on the device, so that entering it again is free
+  it->second.refcount--;
+}
+
+void present_table::update_device(void* p, size_t bytes)
+{
+  std::map<char*, present_entry>::iterator it = find(p, bytes);
+  if (it == entries.end()) return;
+
+  if (it->second.state != PRESENT_HOST_NEWER) { skipped(bytes); return; }
+
+  // the state is kept per entry, so a partial update has to copy the whole
+  // entry to be allowed to mark it as current
+  acc_update_device(it->first, it->second.bytes);
+  counters.bytes_to_device += it->second.bytes;
+  counters.transfers++;
+  it->second.state = PRESENT_BOTH_CURRENT;
+}
+
+void present_table::update_self(void* p, size_t bytes)
+{
+  std::map<char*, present_entry>::iterator it = find(p, bytes);
+  if (it == entries.end()) return;
+
+  if (it->second.state != PRESENT_DEVICE_NEWER) { skipped(bytes); return; }
+
+  acc_update_self(it->first, it->second.bytes);
+  counters.bytes_to_host += it->second.bytes;
+  counters.transfers++;
+  it->second.state = PRESENT_BOTH_CURRENT;
+}
+
+void present_table::mark_host_modified(void* p)
+{
+  std::map<char*, present_entry>::iterator it = find(p, 1);
+  if (it != entries.end()) it->second.state = PRESENT_HOST_NEWER;
+}
+
+void present_table::mark_device_modified(void* p)
+{
+  std::map<char*, present_entry>::iterator it = find(p, 1);
+  if (it != entries.end()) it->second.state = PRESENT_DEVICE_NEWER;
+}
+
+void present_table::forget(void* p)
+{
+  std::map<char*, present_entry>::iterator it = find(p, 1);
+  if (it == entries.end()) return;
+
+  if (it->second.refcount > 0)
+  {
+    printf("present_table: forget of %p, which is still entered\n", p);
+    return;
+  }
+  acc_delete(it->first, it->second.bytes);
+  entries.erase(it);
+}
+
+void present_table::release_all()
+{
+  std::map<char*, present_entry>::iterator it = entries.begin();
+
+  while (it != entries.end())
+  {
+    if (it->second.refcount == 0)
+    {
+      acc_delete(it->first, it->second.bytes);
+      it = entries.erase(it);
+    }
+    else
+    {
+      ++it;
+    }
+  }
+}
+
+void present_table::print_counters(const char* label)
+{
+  printf("%s: %li transfers (%zu bytes to device, %zu bytes to host), "
+    "%li skipped (%zu bytes)\n", label, counters.transfers,
+    counters.bytes_to_device, counters.bytes_to_host,
+    counters.transfers_skipped, counters.bytes_skipped);
+}
+
+present_table present;
+
+////////////////////////////////////////////////////////////////////////////////
+// the grid functions of openacc-present-test.cpp, once with plain directives
+// and once through the present table. The kernel gets the array itself
+// rather than the struct, so only X needs to be on the device.
+
+typedef struct grid
+{
+  int N;
+  double *X;
+} grid;
+
+present_counters direct; // counted by hand for the plain directive version
+
+void allocate_direct(grid* g, int N)
+{
+  g->N = N;
+  g->X = (double*) malloc(sizeof(double) * g->N);
+
+  #pragma acc enter data create(g->X[0:N])
+}
+
+void fill_direct(grid* g, double value)
+{
+  double* X = g->X;
+  int N = g->N;
+  int i;
+
+  #pragma acc parallel loop present(X[0:N])
+  for (i = 0; i < N; i++)
+  {
+    X[i] = value;
+  }
+  #pragma acc update self(X[0:N])
+  direct.bytes_to_host += N * sizeof(double);
+  direct.transfers++;
+}
+
+void release_direct(grid* g)
+{
+  #pragma acc exit data delete(g->X[0:g->N])
+  free(g->X);
+}
+
+void allocate(grid* g, int N)
+{
+  g->N = N;
+  g->X = (double*) malloc(sizeof(double) * g->N);
+}
+
+void enter(grid* g)
+{
+  present.enter(g->X, g->N * sizeof(double), false);
+}
+
+void fill(grid* g, double value)
+{
+  double* X = g->X;
+  int N = g->N;
+  int i;
+
+  #pragma acc parallel loop present(X[0:N])
+  for (i = 0; i < N; i++)
+  {
+    X[i] = value;
+  }
+  present.mark_device_modified(X);
+  present.update_self(X, N * sizeof(double));
+}
+
+void leave(grid* g)
+{
+  present.exit(g->X, false);
+}
+
+void release(grid* g)
+{
+  present.forget(g->X); // before free, which may hand the address out again
+  free(g->X);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int main()
+{
+  const int N = 1000000;
+  const int num_calls = 100;
+  grid g;
+  int k;
+
+  // the pipeline as it was: every call enters, fills and leaves the grid
+  for (k = 0; k < num_calls; k++)
+  {
+    allocate_direct(&g, N);
+    fill_direct(&g, 42.);
+    release_direct(&g);
+  }
+  printf("direct: %li transfers (%zu bytes to host)\n", direct.transfers,
+    direct.bytes_to_host);
+
+  // the same through the present table. The grid only gets created on the
+  // device once. In the first half of the calls the device fills the grid
+  // and the result has to come back, in the second half the calls only need
+  // the host copy to be current, which it already is. At the end we check
+  // that a change on the host is still picked up.
+  allocate(&g, N);
+  for (k = 0; k < num_calls; k++)
+  {
+    enter(&g);
+    if (k < num_calls / 2)
+      fill(&g, 42.);
+    else
+      present.update_self(g.X, N * sizeof(double)); // nothing new on device
+    leave(&g);
+  }
+
+  g.X[0] = 1.;
+  present.mark_host_modified(g.X);
+  present.enter(g.X, N * sizeof(double), true); // must copy: the host is newer
+  present.enter(g.X, N * sizeof(double), true); // must not copy again
+  present.exit(g.X, false);
+  present.exit(g.X + N / 2, false); // an interior pointer finds the range too
+
+  for (k = 0; k < 4; k++)
+  {
+    printf("%d : %f \n", k, g.X[k]);
+  }
+  present.print_counters("present table");
+
+  release(&g);
+  return 0;
+}
@@ -0,0 +1,484 @@
+////////////////////////////////////////////////////////////////////////////////
+// accounting for the data an OpenACC program moves, with the profiling
+// interface
+//
+// compile with gcc -fopenacc -O2 -Wall openacc-profiling-collector.c
+// or, as a library for any OpenACC program,
+//   gcc -fopenacc -fPIC -shared -O2 -Wall -DACC_COLLECTOR_LIBRARY
+//     -o libacc-collector.so openacc-profiling-collector.c
+//   ACC_PROFLIB=./libacc-collector.so ./a.out
+//
+// The enter data, update device, update self and exit data directives of the
+// OpenACC snippets are spread over several functions, and nothing tells how
+// many bytes actually cross between host and device, or when. The OpenACC
+// profiling interface lets a library register callbacks for the runtime's
+// events. This collector registers for
+//
+//   create, delete                 device memory for a variable is set up or
+//                                  released, with its size
+//   enqueue upload, download       a transfer to or from the device, with its
+//                                  size; start and end give the duration
+//   enter data, exit data,         the directives themselves, with their
+//   update, compute construct      duration
+//
+// and records every event with its time, size, source location and duration.
+// Transfers are attributed to variables: a variable is the host range of a
+// create event, and an update of part of an array (update device(A[2:3]))
+// counts for the array it lies in. At exit, the collector prints the event
+// log (or writes it to the file named by ACC_COLLECTOR_LOG) and a table with
+// the bytes uploaded, downloaded and created per variable.
+//
+// Things to know about GCC:
+//
+//   - libgomp calls acc_register_library only for the libraries listed in
+//     ACC_PROFLIB. A program that contains the collector itself, as this one,
+//     has to call it at the start of main().
+//   - it does not fill in the source location (src_file, line_no) nor the
+//     variable name. If the collector is part of the program, ACC_HERE()
+//     before a directive provides the location, and acc_collector_name()
+//     gives a variable a name.
+//   - without a GPU, the host itself is the device (acc_device_host). It
+//     shares the host memory, so there are no create, delete, upload or
+//     download events at all, only the directives with their durations, and
+//     the collector reports zero bytes moved. With an offloading compiler
+//     and a GPU the same code accounts for the transfers.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <acc_prof.h>
+
+#define COLLECTOR_NAME_LENGTH 64
+#define COLLECTOR_LOCATION_LENGTH 96
+
+typedef struct collector_var
+{
+  const char* host_ptr;
+  size_t bytes;
+  char name[COLLECTOR_NAME_LENGTH];
+  char location[COLLECTOR_LOCATION_LENGTH]; // where it was first seen
+
+  long creates, deletes, uploads, downloads;
+  size_t bytes_created, bytes_uploaded, bytes_downloaded;
+  double t_upload, t_download;
+} collector_var;
+
+typedef struct collector_record
+{
+  acc_event_t event;
+  double t;        // at the start of the event, since the collector started
+  double duration; // negative for events that have none (create, delete)
+  size_t bytes;
+  long var;        // index into the variables, -1 for directives
+  long async;
+  char location[COLLECTOR_LOCATION_LENGTH];
+} collector_record;
+
+static struct
+{
+  pthread_mutex_t lock;
+  double t_start;
+  int finished;
+
+  collector_var* vars;
+  long num_vars, max_vars;
+  collector_record* records;
+  long num_records, max_records;
+} collector = { PTHREAD_MUTEX_INITIALIZER, 0., 0, NULL, 0, 0, NULL, 0, 0 };
+
+// per host thread: when the pending start events happened, and the location
+// given by ACC_HERE()
+static __thread double t_upload_start, t_download_start, t_construct_start;
+static __thread char here[COLLECTOR_LOCATION_LENGTH];
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// what the program can call when it contains the collector
+
+#define ACC_HERE() acc_collector_here(__FILE__, __LINE__, __func__)
+
+void acc_collector_here(const char* file, int line, const char* func)
+{
+  snprintf(here, sizeof(here), "%s:%d (%s)", file, line, func);
+}
+
+static long find_var(const void* p); // with the lock held
+static long add_var(const void* p, size_t bytes, const char* location);
+
+void acc_collector_name(const void* host_ptr, size_t bytes, const char* name)
+{
+  pthread_mutex_lock(&collector.lock);
+  long v = find_var(host_ptr);
+  if (v < 0) v = add_var(host_ptr, bytes, "");
+  snprintf(collector.vars[v].name, COLLECTOR_NAME_LENGTH, "%s", name);
+  pthread_mutex_unlock(&collector.lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static long find_var(const void* p)
+{
+  const char* c = p;
+  long v;
+
+  // the most recently created variable that contains p, so that a range that
+  // was deleted and created again is found in its latest incarnation
+  for (v = collector.num_vars - 1; v >= 0; v--)
+  {
+    const collector_var* var = &collector.vars[v];
+    if (c >= var->host_ptr && c < var->host_ptr + (var->bytes > 0 ? var->bytes : 1))
+      return v;
+  }
+  return -1;
+}
+
+static long add_var(const void* p, size_t bytes, const char* location)
+{
+  if (collector.num_vars == collector.max_vars)
+  {
+    collector.max_vars = collector.max_vars > 0 ? 2 * collector.max_vars : 16;
+    collector.vars = realloc(collector.vars,
+      collector.max_vars * sizeof(collector_var));
+  }
+
+  collector_var* var = &collector.vars[collector.num_vars];
+  memset(var, 0, sizeof(collector_var));
+  var->host_ptr = p;
+  var->bytes = bytes;
+  snprintf(var->name, COLLECTOR_NAME_LENGTH, "%p", p);
+  snprintf(var->location, COLLECTOR_LOCATION_LENGTH, "%s", location);
+  return collector.num_vars++;
+}
+
+static void add_record(acc_event_t event, double t, double duration,
+  size_t bytes, long var, long async, const char* location)
+{
+  if (collector.num_records == collector.max_records)
+  {
+    collector.max_records = collector.max_records > 0
+      ? 2 * collector.max_records : 256;
+    collector.records = realloc(collector.records,
+      collector.max_records * sizeof(collector_record));
+  }
+
+  collector_record* r = &collector.records[collector.num_records++];
+  r->event = event;
+  r->t = t - collector.t_start;
+  r->duration = duration;
+  r->bytes = bytes;
+  r->var = var;
+  r->async = async;
+  snprintf(r->location, COLLECTOR_LOCATION_LENGTH, "%s", location);
+}
+
+static const char* event_name(acc_event_t event)
+{
+  switch (event)
+  {
+    case acc_ev_create: return "create";
+    case acc_ev_delete: return "delete";
+    case acc_ev_enqueue_upload_end: return "upload";
+    case acc_ev_enqueue_download_end: return "download";
+    case acc_ev_enter_data_end: return "enter data";
+    case acc_ev_exit_data_end: return "exit data";
+    case acc_ev_update_end: return "update";
+    case acc_ev_compute_construct_end: return "compute";
+    default: return "other";
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// the callbacks
+
+static void location_of(const acc_prof_info* pi, char* location)
+{
+  if (pi->src_file != NULL)
+    snprintf(location, COLLECTOR_LOCATION_LENGTH, "%s:%d (%s)", pi->src_file,
+      pi->line_no, pi->func_name != NULL ? pi->func_name : "?");
+  else if (here[0] != '\0')
+    snprintf(location, COLLECTOR_LOCATION_LENGTH, "%s", here);
+  else
+    snprintf(location, COLLECTOR_LOCATION_LENGTH, "?");
+}
+
+static void on_data_event(acc_prof_info* pi, acc_event_info* ei,
+  acc_api_info* ai)
+{
+  const acc_data_event_info* d = &ei->data_event;
+  char location[COLLECTOR_LOCATION_LENGTH];
+  double t = now();
+  long v;
+
+  // the start events only note the time, everything else happens at the end
+  if (pi->event_type == acc_ev_enqueue_upload_start)
+  {
+    t_upload_start = t;
+    return;
+  }
+  if (pi->event_type == acc_ev_enqueue_download_start)
+  {
+    t_download_start = t;
+    return;
+  }
+
+  location_of(pi, location);
+  pthread_mutex_lock(&collector.lock);
+
+  v = find_var(d->host_ptr);
+  if (pi->event_type == acc_ev_create
+    && (v < 0 || collector.vars[v].host_ptr != (const char*) d->host_ptr))
+  {
+    v = add_var(d->host_ptr, d->bytes, location);
+  }
+  else if (v < 0)
+  {
+    // a transfer of something the collector has not seen created, e.g.
+    // because it was created before the collector was registered
+    v = add_var(d->host_ptr, d->bytes, location);
+  }
+  if (d->var_name != NULL && strncmp(collector.vars[v].name, "0x", 2) == 0)
+    snprintf(collector.vars[v].name, COLLECTOR_NAME_LENGTH, "%s", d->var_name);
+
+  collector_var* var = &collector.vars[v];
+  switch (pi->event_type)
+  {
+    case acc_ev_create:
+      if (var->location[0] == '\0') // named before it was created
+        snprintf(var->location, COLLECTOR_LOCATION_LENGTH, "%s", location);
+      var->creates++;
+      var->bytes_created += d->bytes;
+      add_record(pi->event_type, t, -1., d->bytes, v, pi->async, location);
+      break;
+
+    case acc_ev_delete:
+      var->deletes++;
+      add_record(pi->event_type, t, -1., d->bytes, v, pi->async, location);
+      break;
+
+    case acc_ev_enqueue_upload_end:
+      var->uploads++;
+      var->bytes_uploaded += d->bytes;
+      var->t_upload += t - t_upload_start;
+      add_record(pi->event_type, t_upload_start, t - t_upload_start, d->bytes,
+        v, pi->async, location);
+      break;
+
+    case acc_ev_enqueue_download_end:
+      var->downloads++;
+      var->bytes_downloaded += d->bytes;
+      var->t_download += t - t_download_start;
+      add_record(pi->event_type, t_download_start, t - t_download_start,
+        d->bytes, v, pi->async, location);
+      break;
+
+    default:
+      break;
+  }
+
+  pthread_mutex_unlock(&collector.lock);
+}
+
+static void on_construct_event(acc_prof_info* pi, acc_event_info* ei,
+  acc_api_info* ai)
+{
+  char location[COLLECTOR_LOCATION_LENGTH];
+  double t = now();
+
+  switch (pi->event_type)
+  {
+    case acc_ev_enter_data_start:
+    case acc_ev_exit_data_start:
+    case acc_ev_update_start:
+    case acc_ev_compute_construct_start:
+      t_construct_start = t;
+      return;
+
+    default:
+      break;
+  }
+
+  location_of(pi, location);
+  pthread_mutex_lock(&collector.lock);
+  add_record(pi->event_type, t_construct_start, t - t_construct_start, 0, -1,
+    pi->async, location);
+  pthread_mutex_unlock(&collector.lock);
+
+  // the location given by ACC_HERE() is used up by the directive that follows
+  here[0] = '\0';
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// the report
+
+static void print_bytes(FILE* f, size_t bytes)
+{
+  if (bytes >= (1UL << 30)) fprintf(f, " %9.2f GiB", bytes / 1073741824.);
+  else if (bytes >= (1UL << 20)) fprintf(f, " %9.2f MiB", bytes / 1048576.);
+  else if (bytes >= (1UL << 10)) fprintf(f, " %9.2f KiB", bytes / 1024.);
+  else fprintf(f, " %9zu B  ", bytes);
+}
+
+static void collector_report()
+{
+  const char* filename = getenv("ACC_COLLECTOR_LOG");
+  FILE* f = stderr;
+  size_t total_up = 0, total_down = 0;
+  long k;
+
+  pthread_mutex_lock(&collector.lock);
+  if (collector.finished)
+  {
+    pthread_mutex_unlock(&collector.lock);
+    return;
+  }
+  collector.finished = 1;
+
+  if (filename != NULL && (f = fopen(filename, "w")) == NULL)
+  {
+    perror(filename);
+    f = stderr;
+  }
+
+  fprintf(f, "%12s %-10s %-16s %13s %12s %6s  %s\n", "t (s)", "event",
+    "variable", "bytes", "duration (s)", "async", "location");
+  for (k = 0; k < collector.num_records; k++)
+  {
+    const collector_record* r = &collector.records[k];
+    fprintf(f, "%12.6f %-10s %-16s", r->t, event_name(r->event),
+      r->var >= 0 ? collector.vars[r->var].name : "-");
+    if (r->var >= 0) print_bytes(f, r->bytes); else fprintf(f, " %13s", "-");
+    if (r->duration >= 0.) fprintf(f, " %12.6f", r->duration);
+    else fprintf(f, " %12s", "-");
+    fprintf(f, " %6ld  %s\n", r->async, r->location);
+  }
+  if (f != stderr) fclose(f);
+
+  fprintf(stderr, "\nOpenACC data movement per variable\n");
+  fprintf(stderr, "%-16s %13s %8s %13s %10s %8s %13s %10s  %s\n", "variable",
+    "size", "uploads", "uploaded", "time (s)", "downl.", "downloaded",
+    "time (s)", "first seen at");
+  for (k = 0; k < collector.num_vars; k++)
+  {
+    const collector_var* v = &collector.vars[k];
+    fprintf(stderr, "%-16s", v->name);
+    print_bytes(stderr, v->bytes);
+    fprintf(stderr, " %8ld", v->uploads);
+    print_bytes(stderr, v->bytes_uploaded);
+    fprintf(stderr, " %10.6f %8ld", v->t_upload, v->downloads);
+    print_bytes(stderr, v->bytes_downloaded);
+    fprintf(stderr, " %10.6f  %s\n", v->t_download,
+      v->location[0] != '\0' ? v->location : "-");
+    total_up += v->bytes_uploaded;
+    total_down += v->bytes_downloaded;
+  }
+  fprintf(stderr, "total: %zu bytes uploaded, %zu bytes downloaded\n",
+    total_up, total_down);
+  if (total_up + total_down == 0)
+    fprintf(stderr, "(no transfers: on acc_device_host, the device shares "
+      "the host memory)\n");
+
+  pthread_mutex_unlock(&collector.lock);
+}
+
+static void on_shutdown(acc_prof_info* pi, acc_event_info* ei,
+  acc_api_info* ai)
+{
+  collector_report();
+}
+
+// called by the OpenACC runtime for the libraries in ACC_PROFLIB, and by the
+// program itself otherwise
+void acc_register_library(acc_prof_reg reg, acc_prof_reg unreg,
+  acc_prof_lookup_func lookup)
+{
+  collector.t_start = now();
+
+  reg(acc_ev_create, on_data_event, acc_reg);
+  reg(acc_ev_delete, on_data_event, acc_reg);
+  reg(acc_ev_enqueue_upload_start, on_data_event, acc_reg);
+  reg(acc_ev_enqueue_upload_end, on_data_event, acc_reg);
+  reg(acc_ev_enqueue_download_start, on_data_event, acc_reg);
+  reg(acc_ev_enqueue_download_end, on_data_event, acc_reg);
+
+  reg(acc_ev_enter_data_start, on_construct_event, acc_reg);
+  reg(acc_ev_enter_data_end, on_construct_event, acc_reg);
+  reg(acc_ev_exit_data_start, on_construct_event, acc_reg);
+  reg(acc_ev_exit_data_end, on_construct_event, acc_reg);
+  reg(acc_ev_update_start, on_construct_event, acc_reg);
+  reg(acc_ev_update_end, on_construct_event, acc_reg);
+  reg(acc_ev_compute_construct_start, on_construct_event, acc_reg);
+  reg(acc_ev_compute_construct_end, on_construct_event, acc_reg);
+
+  // runtime_shutdown is not dispatched by every runtime, hence atexit as well
+  reg(acc_ev_runtime_shutdown, on_shutdown, acc_reg);
+  atexit(collector_report);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef ACC_COLLECTOR_LIBRARY
+
+// the lifetime of the grid of openacc-present-test.cpp: copied in, filled on
+// the device, copied back, modified in part on the host and updated in part
+int main(int argc, char** argv)
+{
+  long N_x = 1000, N_y = 1000;
+  long n, i, start, count;
+  double* X;
+  double* Y;
+
+  acc_register_library(acc_prof_register, acc_prof_unregister,
+    acc_prof_lookup);
+
+  if (argc > 2) { N_x = atol(argv[1]); N_y = atol(argv[2]); }
+  n = N_x * N_y;
+  X = malloc(n * sizeof(double));
+  Y = malloc(n * sizeof(double));
+  for (i = 0; i < n; i++) X[i] = 0.;
+
+  acc_collector_name(X, n * sizeof(double), "grid.X");
+  acc_collector_name(Y, n * sizeof(double), "grid.Y");
+
+  ACC_HERE();
+  #pragma acc enter data copyin(X[0:n]) create(Y[0:n])
+
+  ACC_HERE();
+  #pragma acc parallel loop present(X[0:n], Y[0:n])
+  for (i = 0; i < n; i++)
+  {
+    X[i] = 42.;
+    Y[i] = 2. * i;
+  }
+
+  ACC_HERE();
+  #pragma acc update self(X[0:n])
+
+  // one row changes on the host and goes back to the device
+  start = (N_x / 2) * N_y;
+  count = N_y;
+  for (i = start; i < start + count; i++) X[i] = -1.;
+  ACC_HERE();
+  #pragma acc update device(X[start:count])
+
+  ACC_HERE();
+  #pragma acc exit data copyout(Y[0:n]) delete(X[0:n])
+
+  printf("X[0] = %f, X[%ld] = %f, Y[%ld] = %f\n", X[0], start, X[start],
+    n - 1, Y[n - 1]);
+
+  free(X);
+  free(Y);
+  return 0;
+}
+
+#endif
@@ -0,0 +1,355 @@
+// testing per-thread log buffers as a replacement for printf in parallel loops
+//
+// motivation: the parallel snippets print from inside their loops, as in
+// class-shared-array-openMP.cpp:
+//
+//   printf("i = %i, my_ID = %i, dataset pointer = %p\n", ...); fflush(stdout);
+//
+// Every printf takes the lock of stdout, and every fflush makes a write
+// system call while holding it, so the threads take turns, and with more than
+// a few lines per thread the loop does little else. The lines also come out in
+// whatever order the threads happen to get the lock.
+//
+// parallel_log gives every thread a ring buffer of fixed-size records of its
+// own. Writing a line,
+//
+//   L.line(i) << "i = " << i << ", my_ID = " << my_ID << "\n";
+//
+// formats straight into the thread's next record, with std::to_chars for the
+// numbers (no locale, no format string to parse), and stamps the record with
+// the loop index i and the time. No other thread touches that buffer, so
+// there are no locks and no atomics. After the parallel region,
+//
+//   L.flush(LOG_ORDER_INDEX);
+//
+// collects the records of all threads, sorts them by loop index (so the
+// output reads as if the loop had run serially), by time, or not at all
+// (thread by thread), and hands them to the kernel with writev, IOV_MAX
+// records per call, without copying the text again. If a thread writes more
+// records than its ring holds between flushes, its oldest records are
+// overwritten, and flush reports how many were dropped. Lines longer than a
+// record are cut off. There is a ring for each of omp_get_max_threads()
+// threads at construction, for regions that are not nested; line() stops the
+// program for a thread without a ring of its own.
+//
+// main() runs the loop of class-shared-array-openMP.cpp with one line per
+// iteration, once with fprintf + fflush and once for every order of
+// parallel_log, and reports the lines per second.
+//
+// compiled with g++ parallel-log-buffer-openMP.cpp -fopenmp -O2 -Wall
+// run with ./a.out [lines] [output file, default /dev/null]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <charconv>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <omp.h>
+
+#define LOG_RECORD_BYTES 128
+#define LOG_TEXT_BYTES (LOG_RECORD_BYTES - 24)
+
+enum log_order {LOG_ORDER_NONE, LOG_ORDER_INDEX, LOG_ORDER_TIME};
+
+const char* order_names[] = { "by thread", "by index", "by time" };
+
+typedef struct log_record
+{
+  long index;
+  double time;
+  int thread;
+  unsigned short length;
+  char text[LOG_TEXT_BYTES];
+} log_record;
+
+static_assert(sizeof(log_record) == LOG_RECORD_BYTES, "one record, 128 bytes");
+
+// formats into one record. Made by parallel_log::line, and done with the
+// record when it goes out of scope.
+class log_line
+{
+  public:
+
+    log_line(log_record* r_arg) : r(r_arg), p(r_arg->text),
+      end(r_arg->text + LOG_TEXT_BYTES) {}
+    ~log_line() { r->length = (unsigned short) (p - r->text); }
+
+    log_line(const log_line&) = delete;
+    log_line& operator=(const log_line&) = delete;
+
+    log_line& operator<<(const char* s)
+    {
+      size_t n = strlen(s);
+      if (n > (size_t) (end - p)) n = end - p;
+      memcpy(p, s, n);
+      p += n;
+      return *this;
+    }
+
+    log_line& operator<<(char c)
+    {
+      if (p < end) *p++ = c;
+      return *this;
+    }
+
+    log_line& operator<<(long v) { return integer(v); }
+    log_line& operator<<(int v) { return integer(v); }
+    log_line& operator<<(unsigned long v) { return integer(v); }
+
+    // as %f
+    log_line& operator<<(double v)
+    {
+      std::to_chars_result res = std::to_chars(p, end, v,
+        std::chars_format::fixed, 6);
+      if (res.ec == std::errc()) p = res.ptr;
+      return *this;
+    }
+
+    // as %p
+    log_line& operator<<(const void* v)
+    {
+      *this << "0x";
+      std::to_chars_result res = std::to_chars(p, end, (uintptr_t) v, 16);
+      if (res.ec == std::errc()) p = res.ptr;
+      return *this;
+    }
+
+  protected:
+
+    log_record* r;
+    char* p;
+    char* end;
+
+    template <class I>
+    log_line& integer(I v)
+    {
+      std::to_chars_result res = std::to_chars(p, end, v);
+      if (res.ec == std::errc()) p = res.ptr;
+      return *this;
+    }
+};
+
+class parallel_log
+{
+  public:
+
+    parallel_log(int fd_arg, long records_per_thread);
+    ~parallel_log();
+
+    // a new record for the calling thread, for loop index i
+    log_line line(long i);
+
+    // to be called outside of parallel regions
+    long flush(log_order order);
+
+  protected:
+
+    // one thread's ring. alignas keeps the counters of different threads on
+    // different cache lines.
+    struct alignas(64) log_ring
+    {
+      log_record* records;
+      long count; // records written since the last flush
+    };
+
+    int fd;
+    long capacity;
+    std::vector<log_ring> rings;
+    std::chrono::steady_clock::time_point t_start;
+};
+
+parallel_log::parallel_log(int fd_arg, long records_per_thread)
+  : fd(fd_arg), capacity(records_per_thread), rings(omp_get_max_threads())
+{
+  t_start = std::chrono::steady_clock::now();
+
+  // every thread allocates and touches its own ring
+  #pragma omp parallel
+  {
+    log_ring& ring = rings[omp_get_thread_num()];
+    ring.records = new log_record[capacity];
+    memset(ring.records, 0, capacity * sizeof(log_record));
+    ring.count = 0;
+  }
+}
+
+parallel_log::~parallel_log()
+{
+  for (size_t t = 0; t < rings.size(); t++) delete[] rings[t].records;
+}
+
+log_line parallel_log::line(long i)
+{
+  int t = omp_get_thread_num();
+  // one ring per thread of the team size at construction, for one level of
+  // parallelism: threads of nested teams would share a ring
+  if ((size_t) t >= rings.size() || omp_get_level() > 1)
+  {
+    fprintf(stderr, "parallel_log: thread %d at level %d, but only %zu rings "
+      "for one level\n", t, omp_get_level(), rings.size());
+    exit(1);
+  }
+  log_ring& ring = rings[t];
+  log_record* r = &ring.records[ring.count % capacity];
+
+  ring.count++;
+  r->index = i;
+  r->time = std::chrono::duration<double>(std::chrono::steady_clock::now()
+    - t_start).count();
+  r->thread = t;
+  return log_line(r);
+}
+
+static bool by_index(const log_record* a, const log_record* b)
+{
+  return a->index < b->index;
+}
+
+static bool by_time(const log_record* a, const log_record* b)
+{
+  return a->time < b->time;
+}
+
+// writev, continued after partial writes
+static int write_records(int fd, struct iovec* iov, int n)
+{
+  while (n > 0)
+  {
+    ssize_t written = writev(fd, iov, n);
+    if (written < 0) { perror("writev"); return -1; }
+
+    while (n > 0 && (size_t) written >= iov->iov_len)
+    {
+      written -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0)
+    {
+      iov->iov_base = (char*) iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return 0;
+}
+
+long parallel_log::flush(log_order order)
+{
+  std::vector<const log_record*> all;
+  long dropped = 0;
+
+  for (size_t t = 0; t < rings.size(); t++)
+  {
+    log_ring& ring = rings[t];
+    long valid = ring.count < capacity ? ring.count : capacity;
+
+    dropped += ring.count - valid;
+    for (long k = ring.count - valid; k < ring.count; k++)
+      all.push_back(&ring.records[k % capacity]);
+    ring.count = 0;
+  }
+
+  // stable, so that records of the same index stay in the order written
+  if (order == LOG_ORDER_INDEX)
+    std::stable_sort(all.begin(), all.end(), by_index);
+  else if (order == LOG_ORDER_TIME)
+    std::stable_sort(all.begin(), all.end(), by_time);
+
+  std::vector<struct iovec> iov(all.size());
+  for (size_t k = 0; k < all.size(); k++)
+  {
+    iov[k].iov_base = (void*) all[k]->text;
+    iov[k].iov_len = all[k]->length;
+  }
+  for (size_t k = 0; k < iov.size(); k += IOV_MAX)
+  {
+    int n = iov.size() - k < IOV_MAX ? (int) (iov.size() - k) : IOV_MAX;
+    if (write_records(fd, &iov[k], n) != 0) break;
+  }
+
+  if (dropped > 0)
+    fprintf(stderr, "parallel_log: %ld records dropped (rings full)\n", dropped);
+  return dropped;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// the class of class-shared-array-openMP.cpp
+
+class c_test
+{
+  public:
+
+    long* dataset;
+    long res;
+
+    void initialize_dataset(long a_res)
+    {
+      res = a_res;
+      dataset = new long[res];
+      for (long i = 0; i < res; i++) dataset[i] = i;
+    }
+    void deallocate() { delete[] dataset; }
+};
+
+int main(int argc, char** argv)
+{
+  long res = argc > 1 ? atol(argv[1]) : 1000000;
+  const char* filename = argc > 2 ? argv[2] : "/dev/null";
+  int threads = omp_get_max_threads();
+  double t0, t;
+
+  c_test C;
+  C.initialize_dataset(res);
+  long* dataset2 = new long[res];
+
+  FILE* f = fopen(filename, "w");
+  if (f == NULL) { perror(filename); return 1; }
+
+  printf("%ld lines to %s, %d threads\n", res, filename, threads);
+
+  // the pattern of the snippets
+  t0 = omp_get_wtime();
+  #pragma omp parallel for firstprivate(C) schedule(static)
+  for (long i = 0; i < res; i++)
+  {
+    int my_ID = omp_get_thread_num();
+    fprintf(f, "i = %li, my_ID = %i, dataset pointer = %p\n", i, my_ID,
+      (void*) &C.dataset[i]); fflush(f);
+    dataset2[i] = C.dataset[i];
+  }
+  t = omp_get_wtime() - t0;
+  printf("%-26s %8.3f s, %12.0f lines/s\n", "fprintf + fflush", t, res / t);
+
+  // the same loop with a parallel_log, big enough for all lines of a thread
+  // with schedule(static)
+  parallel_log L(fileno(f), (res + threads - 1) / threads + 1);
+  for (int order = LOG_ORDER_NONE; order <= LOG_ORDER_TIME; order++)
+  {
+    t0 = omp_get_wtime();
+    #pragma omp parallel for firstprivate(C) schedule(static)
+    for (long i = 0; i < res; i++)
+    {
+      int my_ID = omp_get_thread_num();
+      L.line(i) << "i = " << i << ", my_ID = " << my_ID
+        << ", dataset pointer = " << (const void*) &C.dataset[i] << '\n';
+      dataset2[i] = C.dataset[i];
+    }
+    L.flush((log_order) order);
+    t = omp_get_wtime() - t0;
+
+    printf("parallel_log, %-12s %8.3f s, %12.0f lines/s\n",
+      order_names[order], t, res / t);
+  }
+
+  fclose(f);
+  delete[] dataset2;
+  C.deallocate();
+  return 0;
+}
@@ -0,0 +1,269 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// keeping track of which parts of an array need an update device
+//
+// compile with gcc -Wall -O2 update-device-dirty-ranges-openacc.c (host
+// backend) or pgcc -acc update-device-dirty-ranges-openacc.c
+//
+// update-device-openacc.c shows how to copy only part of a modified host array
+// to the device, with update device(A[2:3]). In real code, keeping such ranges
+// in line with what the host code actually modified is easy to get wrong, and
+// updating the whole array instead wastes bandwidth.
+//
+// This snippet wraps the array in a struct that the host code reports its
+// modifications to:
+//
+//   dirty_mark(&D, start, count)   entries start ... start + count - 1 changed
+//   dirty_flush(&D)                bring the device copy up to date
+//
+// dirty_flush sorts the recorded ranges and merges those that overlap, touch,
+// or are separated by at most gap_threshold entries. Moving a few unmodified
+// entries along is cheaper than starting a separate transfer for them, so the
+// threshold trades bytes for number of transfers. The merged intervals are
+// then sent with one partial update device each.
+//
+// Without OpenACC, a host backend stands in for the device: the struct holds
+// a second array, the 'mirror', and the intervals are copied into it with
+// memcpy. That way main() can check that the mirror ends up identical to the
+// host array, ie that no modification was missed.
+//
+// The struct also counts the bytes actually sent, against the bytes that
+// updating the whole array on every flush would have sent.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define DIRTY_MAX_RANGES 4096 // merge early if this many ranges are recorded
+
+typedef struct dirty_range
+{
+  long start;
+  long end; // one past the last entry
+} dirty_range;
+
+typedef struct dirty_array
+{
+  double* A;
+  long N;
+  long gap_threshold;
+
+  dirty_range* ranges;
+  long num_ranges;
+
+#ifndef _OPENACC
+  double* mirror; // stands in for the device copy
+#endif
+
+  // statistics
+  long flushes;
+  long transfers;
+  size_t bytes_sent;
+  size_t bytes_whole; // what updating the whole array would have sent
+} dirty_array;
+
+////////////////////////////////////////////////////////////////////////////////
+
+void dirty_init(dirty_array* D, long N, long gap_threshold)
+{
+  D->A = malloc(N * sizeof(double));
+  D->N = N;
+  D->gap_threshold = gap_threshold;
+  D->ranges = malloc(DIRTY_MAX_RANGES * sizeof(dirty_range));
+  D->num_ranges = 0;
+  D->flushes = 0;
+  D->transfers = 0;
+  D->bytes_sent = 0;
+  D->bytes_whole = 0;
+
+#ifdef _OPENACC
+  #pragma acc enter data create(D->A[0:N])
+#else
+  D->mirror = malloc(N * sizeof(double));
+#endif
+}
+
+void dirty_free(dirty_array* D)
+{
+#ifdef _OPENACC
+  #pragma acc exit data delete(D->A[0:D->N])
+#else
+  free(D->mirror);
+#endif
+  free(D->A);
+  free(D->ranges);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static int compare_ranges(const void* a, const void* b)
+{
+  const dirty_range* ra = a;
+  const dirty_range* rb = b;
+
+  if (ra->start < rb->start) return -1;
+  if (ra->start > rb->start) return 1;
+  return 0;
+}
+
+// sort the ranges and merge those at most gap_threshold entries apart
+static void dirty_coalesce(dirty_array* D)
+{
+  long k, m;
+
+  if (D->num_ranges < 2) return;
+
+  qsort(D->ranges, D->num_ranges, sizeof(dirty_range), compare_ranges);
+
+  m = 0;
+  for (k = 1; k < D->num_ranges; k++)
+  {
+    if (D->ranges[k].start <= D->ranges[m].end + D->gap_threshold)
+    {
+      if (D->ranges[k].end > D->ranges[m].end)
+        D->ranges[m].end = D->ranges[k].end;
+    }
+    else
+    {
+      D->ranges[++m] = D->ranges[k];
+    }
+  }
+  D->num_ranges = m + 1;
+}
+
+void dirty_mark(dirty_array* D, long start, long count)
+{
+  if (count <= 0) return;
+
+  // consecutive marks of neighbouring entries (the common case of a loop
+  // over the array) are extended in place rather than recorded separately
+  if (D->num_ranges > 0)
+  {
+    dirty_range* last = &D->ranges[D->num_ranges - 1];
+    if (start >= last->start && start <= last->end)
+    {
+      if (start + count > last->end) last->end = start + count;
+      return;
+    }
+  }
+
+  if (D->num_ranges == DIRTY_MAX_RANGES)
+  {
+    dirty_coalesce(D);
+    // if merging did not free up enough room, give up on precision and
+    // merge everything into one range
+    if (D->num_ranges > DIRTY_MAX_RANGES / 2)
+    {
+      D->ranges[0].end = D->ranges[D->num_ranges - 1].end;
+      D->num_ranges = 1;
+    }
+  }
+
+  D->ranges[D->num_ranges].start = start;
+  D->ranges[D->num_ranges].end = start + count;
+  D->num_ranges++;
+}
+
+void dirty_flush(dirty_array* D)
+{
+  long k, start, count;
+
+  dirty_coalesce(D);
+
+  for (k = 0; k < D->num_ranges; k++)
+  {
+    start = D->ranges[k].start;
+    count = D->ranges[k].end - start;
+
+#ifdef _OPENACC
+    #pragma acc update device(D->A[start:count])
+#else
+    memcpy(D->mirror + start, D->A + start, count * sizeof(double));
+#endif
+
+    D->transfers++;
+    D->bytes_sent += count * sizeof(double);
+  }
+
+  D->num_ranges = 0;
+  D->flushes++;
+  D->bytes_whole += D->N * sizeof(double);
+}
+
+void dirty_print_stats(const dirty_array* D)
+{
+  printf("gap %6li: %5li flushes, %7li transfers, %10zu bytes sent, "
+    "%10zu for whole-array updates (%.1f%% saved)\n", D->gap_threshold,
+    D->flushes, D->transfers, D->bytes_sent, D->bytes_whole,
+    100. * (1. - (double) D->bytes_sent / D->bytes_whole));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int main()
+{
+  const long gaps[] = { 0, 8, 64, 1024 };
+  const long N = 1000000;
+  const int num_steps = 100;
+  const int writes_per_step = 200;
+  dirty_array D;
+  long i, k, start, count;
+  int g, step;
+
+  // the example of update-device-openacc.c: everything changes on the host,
+  // but (deliberately) only A[2:3] is marked
+  dirty_init(&D, 10, 0);
+  for (i = 0; i < 10; i++) D.A[i] = 1.;
+  dirty_mark(&D, 0, 10);
+  dirty_flush(&D);
+  for (i = 0; i < 10; i++) D.A[i] = 2.;
+  dirty_mark(&D, 2, 3);
+  dirty_flush(&D);
+#ifndef _OPENACC
+  for (i = 0; i < 10; i++)
+  {
+    printf("device: A[%ld] = %e\n", i, D.mirror[i]);
+  }
+#endif
+  dirty_free(&D);
+
+  // a larger test: every step modifies a few hundred short, scattered runs
+  // of entries, after which the device copy gets updated
+  for (g = 0; g < (int) (sizeof(gaps) / sizeof(gaps[0])); g++)
+  {
+    dirty_init(&D, N, gaps[g]);
+    for (i = 0; i < N; i++) D.A[i] = 0.;
+    dirty_mark(&D, 0, N);
+    dirty_flush(&D);
+    D.flushes = D.transfers = D.bytes_sent = D.bytes_whole = 0;
+
+    srand(42);
+    for (step = 0; step < num_steps; step++)
+    {
+      for (k = 0; k < writes_per_step; k++)
+      {
+        start = rand() % N;
+        count = 1 + rand() % 16;
+        if (start + count > N) count = N - start;
+        for (i = start; i < start + count; i++) D.A[i] += 1.;
+        dirty_mark(&D, start, count);
+      }
+      dirty_flush(&D);
+    }
+
+    dirty_print_stats(&D);
+
+#ifndef _OPENACC
+    if (memcmp(D.A, D.mirror, N * sizeof(double)) != 0)
+    {
+      printf("the mirror differs from the host array\n");
+      return 1;
+    }
+#endif
+    dirty_free(&D);
+  }
+
+  return 0;
+}